@@ -17,6 +17,20 @@
 #include "aesd-circular-buffer.h"
 
 
+/**
+ * @param buffer
+ *				the buffer to count entries of
+ * @return
+ *				the number of entries held, from out_offs up to in_offs
+ */
+
+unsigned int aesd_circular_buffer_count(struct aesd_circular_buffer *buffer)
+{
+	if (buffer->full) return buffer->capacity;
+
+	return (buffer->in_offs + buffer->capacity - buffer->out_offs) % buffer->capacity;
+}
+
 /**
  * @param buffer 
  * 				the buffer to search for corresponding offset.  
@@ -37,38 +51,71 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
 	struct aesd_circular_buffer *buffer,
     size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    /**
-    * TODO: implement per description
-    */
-	int i, out_offs;
+	unsigned int lo, hi, mid, count;
+	uint64_t target;
 	struct aesd_buffer_entry *entry;
 
-	// check if buffer is empty
-	if (!buffer->full && buffer->in_offs == buffer->out_offs) {
+	// check if buffer is empty or not enough data is written. The count is
+	// read once and checked too: a lockless reader may see the size from
+	// before an eviction and the offsets from after it
+	count = aesd_circular_buffer_count(buffer);
+	if (char_offset >= buffer->size || count == 0) {
 		return NULL;
 	} 
 
-	for(i=0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-
-		// reading position
-		out_offs = (buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	// binary search on the logical offsets for the last entry starting at or
+	// before the target: entries are ordered by offs from out_offs
+	target = buffer->base + char_offset;
+	lo = 0;
+	hi = count - 1;
 
-		// passed data area
-		if (out_offs == buffer->in_offs && !buffer->full) return NULL;
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
 
-		// get entry
-		entry = &buffer->entry[out_offs];
-		
-		if (char_offset < entry->size) {
-			*entry_offset_byte_rtn = char_offset;
-			return entry;
-		}
+		entry = &buffer->entry[(buffer->out_offs + mid) % buffer->capacity];
 
-		// decrease offet by the current data size
-		char_offset -= entry->size;
+		if (entry->offs <= target) lo = mid;
+		else hi = mid - 1;
 	}
 
-    return NULL;
+	entry = &buffer->entry[(buffer->out_offs + lo) % buffer->capacity];
+
+	*entry_offset_byte_rtn = target - entry->offs;
+
+	return entry;
+}
+
+/**
+ * @param buffer
+ *				the buffer holding the entry.
+ *				Any necessary locking must be performed by caller.
+ * @param entry_index
+ *				the zero referenced entry, counted from the oldest entry (out_offs)
+ * @param entry_offset
+ *				the zero referenced byte within the entry
+ * @param fpos_rtn
+ *				is a pointer specifying a location to store the position of this byte if all
+ *				buffer strings were concatenated end to end.
+ *				This value is only set when the entry and byte exist.
+ * @return
+ *				true if the entry and byte exist in the buffer
+ */
+
+bool aesd_circular_buffer_find_fpos_for_entry(
+	struct aesd_circular_buffer *buffer,
+	unsigned int entry_index, size_t entry_offset, size_t *fpos_rtn)
+{
+	struct aesd_buffer_entry *entry;
+
+	if (entry_index >= aesd_circular_buffer_count(buffer)) return false;
+
+	entry = &buffer->entry[(buffer->out_offs + entry_index) % buffer->capacity];
+
+	if (entry_offset >= entry->size) return false;
+
+	*fpos_rtn = entry->offs - buffer->base + entry_offset;
+
+	return true;
 }
 
 /**
@@ -83,38 +130,251 @@ void aesd_circular_buffer_add_entry(
 	struct aesd_circular_buffer *buffer, 
 	const struct aesd_buffer_entry *add_entry)
 {
-    /** * TODO: implement per description */
 	// assumes that 'in_offs' and 'out_offs' are valid always
+	struct aesd_buffer_entry *slot = &buffer->entry[buffer->in_offs];
 
-	// assign first
-    buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
-	buffer->entry[buffer->in_offs].size = add_entry->size;
+	// if buffer was full, the oldest entry (at in_offs) is overwritten
+	if (buffer->full) {
+		// decrease the total size, the logical start moves past it
+		buffer->size -= slot->size;
+		buffer->base += slot->size;
+		// move reading hearder forward
+		buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+	} 
+
+	// assign, the new entry starts where the retained data ends
+    slot->buffptr = add_entry->buffptr;
+	slot->size = add_entry->size;
+	slot->offs = buffer->base + buffer->size;
 	buffer->size += add_entry->size;
 
 	// move write header forward
-	buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+	buffer->in_offs = (buffer->in_offs + 1) % buffer->capacity;
 
-	// if buffer was full, move reading header forward too
-	if (buffer->full) {
-		// decrease the total size
-		buffer->size -= buffer->entry[buffer->out_offs].size;
-		// move reading hearder forward
-		buffer->out_offs = buffer->in_offs;
-	} 
 	// check if buffer full
-	else if(buffer->in_offs == buffer->out_offs) {
+	if(buffer->in_offs == buffer->out_offs) {
 		buffer->full = true; 
 	}
 }
 
+/**
+* @return true if the oldest entry of @param buffer must be removed before adding an entry of
+* @param size bytes: the entry array is full or the byte capacity (max_bytes) would be exceeded.
+* An entry larger than max_bytes is kept alone once every other entry is removed.
+*/
+
+bool aesd_circular_buffer_needs_eviction(
+	struct aesd_circular_buffer *buffer, size_t size)
+{
+	if (buffer->full) return true;
+
+	return buffer->max_bytes > 0 && buffer->size > 0 && buffer->size + size > buffer->max_bytes;
+}
+
+/**
+* Removes the oldest entry of @param buffer and stores it in @param removed_entry so that
+* the caller can release its memory.
+* Any necessary locking must be handled by the caller
+* @return false if the buffer is empty
+*/
+
+bool aesd_circular_buffer_remove_entry(
+	struct aesd_circular_buffer *buffer,
+	struct aesd_buffer_entry *removed_entry)
+{
+	struct aesd_buffer_entry *slot = &buffer->entry[buffer->out_offs];
+
+	if (!buffer->full && buffer->in_offs == buffer->out_offs) return false;
+
+	*removed_entry = *slot;
+
+	buffer->size -= slot->size;
+	buffer->base += slot->size;
+	buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+	buffer->full = false;
+
+	slot->buffptr = NULL;
+	slot->size = 0;
+
+	// ring: the older bytes are gone once the oldest entry is the one which restarted at 0
+	if (buffer->ring != NULL) {
+		if (buffer->in_offs == buffer->out_offs) {
+			buffer->ring_head = 0;
+			buffer->ring_wrap = 0;
+		} else if (buffer->entry[buffer->out_offs].buffptr == buffer->ring) {
+			buffer->ring_wrap = 0;
+		}
+	}
+
+	return true;
+}
+
+/**
+* Reserves @param size contiguous bytes of the ring of @param buffer for the next entry, after
+* the newest entry or at the start of the ring when the end is too short.
+* The caller removes the oldest entry and tries again while there is not enough room, then
+* copies the content and adds the entry with buffptr set to the returned location.
+* Any necessary locking must be handled by the caller
+* @return the location of the entry in the ring, NULL if the oldest entries use the room
+*/
+
+char *aesd_circular_buffer_reserve(
+	struct aesd_circular_buffer *buffer, size_t size)
+{
+	size_t pos, tail;
+
+	if (size == 0 || size > buffer->ring_size) return NULL;
+
+	if (aesd_circular_buffer_count(buffer) == 0) {
+		pos = 0;
+	} else {
+		tail = buffer->entry[buffer->out_offs].buffptr - buffer->ring;
+
+		if (buffer->ring_wrap > 0) {
+			// the newest entries are below the oldest ones
+			if (tail - buffer->ring_head < size) return NULL;
+			pos = buffer->ring_head;
+		} else if (buffer->ring_size - buffer->ring_head >= size) {
+			pos = buffer->ring_head;
+		} else if (tail >= size) {
+			buffer->ring_wrap = buffer->ring_head;
+			pos = 0;
+		} else {
+			return NULL;
+		}
+	}
+
+	buffer->ring_head = pos + size;
+
+	return buffer->ring + pos;
+}
+
+/**
+* Places @param cursor of @param buffer on @param char_offset, for aesd_circular_buffer_cursor_next
+* to walk the entries from there in logical order (oldest first) without searching again.
+* Any necessary locking must be handled by the caller, for as long as the cursor is used
+* @return false if this position is not available in the buffer, the cursor then yields nothing
+*/
+
+bool aesd_circular_buffer_cursor_init(
+	struct aesd_circular_buffer *buffer,
+	struct aesd_circular_buffer_cursor *cursor, size_t char_offset)
+{
+	struct aesd_buffer_entry *entry;
+	size_t entry_offset;
+
+	cursor->buffer = buffer;
+	cursor->count = aesd_circular_buffer_count(buffer);
+	cursor->index = cursor->count;
+	cursor->offset = 0;
+
+	entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &entry_offset);
+
+	if (entry == NULL) return false;
+
+	cursor->index = (entry - buffer->entry + buffer->capacity - buffer->out_offs) % buffer->capacity;
+	cursor->offset = entry_offset;
+
+	return true;
+}
+
+/**
+* Stores in @param span the bytes of the entry at @param cursor, from the cursor to the end of
+* the entry, and moves the cursor to the next entry. The following entries stored right after it
+* (in the ring, or in caller memory) extend the span until it reaches @param max_len bytes: a
+* span may end up longer, the caller takes what it needs from it.
+* @return false when the cursor is past the newest entry, @param span is not set then
+*/
+
+bool aesd_circular_buffer_cursor_next(
+	struct aesd_circular_buffer_cursor *cursor,
+	size_t max_len, struct aesd_ring_span *span)
+{
+	struct aesd_circular_buffer *buffer = cursor->buffer;
+	struct aesd_buffer_entry *entry;
+
+	if (cursor->index >= cursor->count) return false;
+
+	entry = &buffer->entry[(buffer->out_offs + cursor->index) % buffer->capacity];
+
+	span->ptr = entry->buffptr + cursor->offset;
+	span->len = entry->size - cursor->offset;
+
+	cursor->index++;
+	cursor->offset = 0;
+
+	while (span->len < max_len && cursor->index < cursor->count) {
+		entry = &buffer->entry[(buffer->out_offs + cursor->index) % buffer->capacity];
+
+		if (entry->buffptr != span->ptr + span->len) break;
+
+		span->len += entry->size;
+		cursor->index++;
+	}
+
+	return true;
+}
+
+/**
+* Points the entries of @param buffer to @param ring, a copy of the ring of the same size made by
+* the caller, which releases the previous ring.
+* Any necessary locking must be handled by the caller
+*/
+
+void aesd_circular_buffer_move_ring(
+	struct aesd_circular_buffer *buffer, char *ring)
+{
+	struct aesd_buffer_entry *entry;
+	unsigned int i;
+
+	AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry, buffer, i) {
+		entry->buffptr = ring + (entry->buffptr - buffer->ring);
+	}
+
+	buffer->ring = ring;
+}
+
+/**
+* Moves the entries of @param buffer, oldest first, into @param entries, an array of
+* @param capacity elements allocated by the caller.
+* The caller must first remove the oldest entries which do not fit in capacity.
+* Any necessary locking must be handled by the caller
+* @return the previous entry array for the caller to release, NULL if it was the inline storage
+*/
+
+struct aesd_buffer_entry *aesd_circular_buffer_resize(
+	struct aesd_circular_buffer *buffer,
+	struct aesd_buffer_entry *entries, uint32_t capacity)
+{
+	struct aesd_buffer_entry *old = buffer->entry;
+	unsigned int i, count = aesd_circular_buffer_count(buffer);
+
+	memset(entries, 0, capacity * sizeof(struct aesd_buffer_entry));
+
+	for (i = 0; i < count && i < capacity; i++) {
+		entries[i] = buffer->entry[(buffer->out_offs + i) % buffer->capacity];
+	}
+
+	buffer->entry = entries;
+	buffer->capacity = capacity;
+	buffer->out_offs = 0;
+	buffer->in_offs = i % capacity;
+	buffer->full = (i == capacity);
+
+	return (old == buffer->inline_entry) ? NULL : old;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* holding up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
 
+	buffer->entry = buffer->inline_entry;
+	buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 	buffer->in_offs = 0;
 	buffer->out_offs = 0;
 	buffer->full = false;
@@ -16,6 +16,8 @@
 #include <stdbool.h>
 #endif
 
+// Default capacity, the entry array can be replaced by a larger one with
+// aesd_circular_buffer_resize
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
 struct aesd_buffer_entry
@@ -25,31 +27,84 @@ struct aesd_buffer_entry
 
     // Number of bytes stored in buffptr 
     size_t size;
+
+    // Logical offset of the first byte, the sum of the sizes of every entry
+    // added before this one (running prefix sum, never rewinds)
+    uint64_t offs;
+};
+
+// contiguous bytes of the history, see aesd_circular_buffer_cursor_next
+struct aesd_ring_span
+{
+    const char *ptr;
+    size_t len;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * inline_entry after init or the array given to aesd_circular_buffer_resize
+     */
+    struct aesd_buffer_entry  *entry;
+    /**
+     * Number of elements in the entry array
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
 	/**
 	 * total size of entries in the buffer
 	 */
 	size_t size;
+	/**
+	 * logical offset of the first byte of the entry at out_offs, fpos 0
+	 * corresponds to this offset
+	 */
+	uint64_t base;
+	/**
+	 * byte capacity, 0 when only the number of entries is limited
+	 */
+	size_t max_bytes;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Optional contiguous storage of the entries (NULL when the entries point
+     * to memory managed by the caller). An entry never wraps: when it does not
+     * fit before the end of the ring it starts at 0 again, and ring_wrap keeps
+     * the end of the older bytes until the entries above it are removed.
+     */
+    char *ring;
+    size_t ring_size;
+    size_t ring_head;
+    size_t ring_wrap;
+    /**
+     * Default entry storage, the buffer must not be copied while entry points here
+     */
+    struct aesd_buffer_entry  inline_entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+};
+
+/**
+ * Position in the entries of a buffer, walked in logical order (oldest first) by
+ * aesd_circular_buffer_cursor_next
+ */
+struct aesd_circular_buffer_cursor
+{
+    struct aesd_circular_buffer *buffer;
+    // entry of the next span, counted from out_offs, and entries in the buffer
+    unsigned int index;
+    unsigned int count;
+    // byte of that entry where the next span starts
+    size_t offset;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
@@ -60,16 +115,48 @@ extern void aesd_circular_buffer_add_entry(
 	struct aesd_circular_buffer *buffer, 
 	const struct aesd_buffer_entry *add_entry);
 
+extern bool aesd_circular_buffer_find_fpos_for_entry(
+	struct aesd_circular_buffer *buffer,
+	unsigned int entry_index, size_t entry_offset, size_t *fpos_rtn);
+
+extern unsigned int aesd_circular_buffer_count(struct aesd_circular_buffer *buffer);
+
+extern bool aesd_circular_buffer_needs_eviction(
+	struct aesd_circular_buffer *buffer, size_t size);
+
+extern bool aesd_circular_buffer_remove_entry(
+	struct aesd_circular_buffer *buffer,
+	struct aesd_buffer_entry *removed_entry);
+
+extern char *aesd_circular_buffer_reserve(
+	struct aesd_circular_buffer *buffer, size_t size);
+
+extern bool aesd_circular_buffer_cursor_init(
+	struct aesd_circular_buffer *buffer,
+	struct aesd_circular_buffer_cursor *cursor, size_t char_offset);
+
+extern bool aesd_circular_buffer_cursor_next(
+	struct aesd_circular_buffer_cursor *cursor,
+	size_t max_len, struct aesd_ring_span *span);
+
+extern void aesd_circular_buffer_move_ring(
+	struct aesd_circular_buffer *buffer, char *ring);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_resize(
+	struct aesd_circular_buffer *buffer,
+	struct aesd_buffer_entry *entries, uint32_t capacity);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 /**
- * Create a for loop to iterate over each member of the circular buffer.
+ * Create a for loop to iterate over each member of the circular buffer, every slot of the
+ * entry array in storage order.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is an unsigned int stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * unsigned int index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -78,9 +165,23 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
+/**
+ * Same as AESD_CIRCULAR_BUFFER_FOREACH over the entries held, in logical order: from the
+ * oldest entry (out_offs), index counting the entries from it.
+ * Example usage:
+ * AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry,&buffer,index) {
+ *      sizes[index] = entry->size;
+ * }
+ */
+#define AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entryptr,buffer,index) \
+    for(index=0; \
+            index<aesd_circular_buffer_count(buffer) && \
+            ((entryptr)=&((buffer)->entry[((buffer)->out_offs+index)%(buffer)->capacity]), true); \
+            index++)
+
 
 
 #endif /* AESD_CIRCULAR_BUFFER_H */
@@ -0,0 +1,312 @@
+/**
+ * @file aesd-core.c
+ * @brief Write staging and commit of the aesdchar driver, built in the module
+ * and in userspace (see aesd-core.h)
+ *
+ * None of these functions locks, the caller does; chunks come from and go
+ * back to the caller through struct aesd_core_ops.
+ */
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/string.h>
+#else
+#include <errno.h>
+#include <string.h>
+#endif
+
+#include "aesd-core.h"
+
+/**
+ * @return the number of bytes of @param data (@param n bytes) up to and
+ * including the first newline, @param n when there is none
+ */
+
+size_t aesd_core_command_len(const char *data, size_t n)
+{
+	const char *newline = memchr(data, '\n', n);
+
+	return (newline != NULL) ? newline + 1 - data : n;
+}
+
+/**
+ * Chains @param chunk at the end of @param working, its used bytes count in
+ * the size of the command
+ */
+
+void aesd_core_append_chunk(struct aesd_working *working, struct aesd_chunk *chunk)
+{
+	chunk->next = NULL;
+
+	if (working->tail != NULL) {
+		working->tail->next = chunk;
+	} else {
+		working->head = chunk;
+	}
+	working->tail = chunk;
+	working->size += chunk->used;
+}
+
+/**
+ * Moves the chain of @param src to the end of @param dst, @param src is left empty
+ */
+
+void aesd_core_splice(struct aesd_working *dst, struct aesd_working *src)
+{
+	if (src->head == NULL) return;
+
+	if (dst->tail != NULL) {
+		dst->tail->next = src->head;
+	} else {
+		dst->head = src->head;
+	}
+	dst->tail = src->tail;
+	dst->size += src->size;
+
+	src->head = src->tail = NULL;
+	src->size = 0;
+}
+
+/**
+ * Detaches the first complete command of @param batch: every command ends
+ * with the chunk holding its newline, the next one starts in a fresh chunk.
+ * @return the chain of the command, its size in @param size, NULL when the
+ * batch holds no complete command (it is left unchanged then)
+ */
+
+struct aesd_chunk *aesd_core_next_command(struct aesd_working *batch, size_t *size)
+{
+	struct aesd_chunk *head = batch->head, *chunk;
+	size_t n = 0;
+
+	for (chunk = head; chunk != NULL; chunk = chunk->next) {
+		n += chunk->used;
+
+		if (chunk->used > 0 && chunk->data[chunk->used - 1] == '\n') {
+			batch->head = chunk->next;
+			if (batch->head == NULL) batch->tail = NULL;
+			batch->size -= n;
+
+			chunk->next = NULL;
+			*size = n;
+			return head;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Copies the bytes of the chain from @param head to @param dst, one linear copy
+ */
+
+void aesd_core_copy_chain(char *dst, const struct aesd_chunk *head)
+{
+	const struct aesd_chunk *chunk;
+
+	for (chunk = head; chunk != NULL; chunk = chunk->next) {
+		memcpy(dst, chunk->data, chunk->used);
+		dst += chunk->used;
+	}
+}
+
+static void aesd_core_evict(struct aesd_circular_buffer *buffer, aesd_evict_fn evict, void *ctx)
+{
+	struct aesd_buffer_entry removed;
+
+	if (evict != NULL) {
+		evict(ctx);
+	} else {
+		aesd_circular_buffer_remove_entry(buffer, &removed);
+	}
+}
+
+/**
+ * Evicts the oldest entries of @param buffer until an entry of @param size bytes
+ * fits (entry count, byte capacity, then ring space) by calling @param evict with
+ * @param ctx, or aesd_circular_buffer_remove_entry when it is NULL.
+ * The size must not exceed the ring size.
+ * Any necessary locking must be handled by the caller
+ * @return the location of the entry in the ring, for aesd_circular_buffer_add_entry
+ */
+
+char *aesd_core_make_room(struct aesd_circular_buffer *buffer, size_t size,
+	aesd_evict_fn evict, void *ctx)
+{
+	char *dst;
+
+	while (aesd_circular_buffer_needs_eviction(buffer, size)) {
+		aesd_core_evict(buffer, evict, ctx);
+	}
+
+	while ((dst = aesd_circular_buffer_reserve(buffer, size)) == NULL) {
+		aesd_core_evict(buffer, evict, ctx);
+	}
+
+	return dst;
+}
+
+/**
+ * Room for the next bytes of the command in @param working: the free end of
+ * its last chunk, a new chunk from @param ops alloc when it is full.
+ * @return where the caller copies up to @param room bytes before calling
+ * aesd_core_stage, NULL when no chunk is available
+ */
+
+char *aesd_core_stage_buffer(struct aesd_working *working, size_t *room,
+	const struct aesd_core_ops *ops, void *ctx)
+{
+	struct aesd_chunk *chunk = working->tail;
+
+	if (chunk == NULL || chunk->used == AESD_CHUNK_DATA) {
+		chunk = ops->alloc(ctx);
+		if (chunk == NULL) return NULL;
+
+		aesd_core_append_chunk(working, chunk);
+	}
+
+	*room = AESD_CHUNK_DATA - chunk->used;
+
+	return chunk->data + chunk->used;
+}
+
+/**
+ * Stages the @param copied bytes copied to aesd_core_stage_buffer of @param working.
+ * Only the bytes up to the first newline are taken, their count is returned in
+ * @param used: the caller copies the rest again as the start of the next command.
+ * A command complete with its newline moves to @param batch for aesd_core_next_command.
+ * @return 1 when a command was completed, 0 when it goes on, -EFBIG when it grew
+ * beyond @param ring_size: it could never be stored, its chunks are released
+ */
+
+int aesd_core_stage(struct aesd_working *working, struct aesd_working *batch,
+	size_t copied, size_t *used, size_t ring_size, const struct aesd_core_ops *ops, void *ctx)
+{
+	struct aesd_chunk *chunk = working->tail;
+	char *dst = chunk->data + chunk->used;
+	size_t len = aesd_core_command_len(dst, copied);
+
+	*used = len;
+
+	if (working->size + len > ring_size) {
+		ops->release(ctx, working->head);
+		working->head = working->tail = NULL;
+		working->size = 0;
+
+		return -EFBIG;
+	}
+
+	chunk->used += len;
+	working->size += len;
+
+	if (len == 0 || dst[len - 1] != '\n') return 0;
+
+	aesd_core_splice(batch, working);
+
+	return 1;
+}
+
+/**
+ * Moves a complete command (chain of @param size bytes from @param head) to
+ * @param buffer, evicting the oldest entries until it fits. The partial command
+ * left in @param orphan (may be NULL) goes in front of it, or is dropped when
+ * both would not fit in the ring. The chunks are released once copied.
+ * Any necessary locking must be handled by the caller
+ */
+
+void aesd_core_commit(struct aesd_circular_buffer *buffer, struct aesd_working *orphan,
+	struct aesd_chunk *head, size_t size, const struct aesd_core_ops *ops, void *ctx)
+{
+	struct aesd_buffer_entry entry;
+
+	if (orphan != NULL && orphan->head != NULL) {
+		if (orphan->size > buffer->ring_size - size) {
+			ops->release(ctx, orphan->head);
+		} else {
+			orphan->tail->next = head;
+			head = orphan->head;
+			size += orphan->size;
+		}
+
+		orphan->head = orphan->tail = NULL;
+		orphan->size = 0;
+	}
+
+	if (ops->change_begin != NULL) ops->change_begin(ctx);
+
+	entry.buffptr = aesd_core_make_room(buffer, size, ops->evict, ctx);
+	entry.size = size;
+
+	// one linear copy, then the chunks are free again
+	aesd_core_copy_chain((char *) entry.buffptr, head);
+
+	aesd_circular_buffer_add_entry(buffer, &entry);
+	if (ops->added != NULL) ops->added(ctx);
+
+	if (ops->change_end != NULL) ops->change_end(ctx);
+
+	ops->release(ctx, head);
+}
+
+/**
+ * Copies the history of @param buffer from @param pos on, @param max_len bytes at most,
+ * by calling @param copy with @param ctx. The entries are contiguous in the ring, the
+ * cursor merges them into two copies at most (when the newest entries restarted at 0).
+ * Called with the buffer locked, or without a lock by a reader which then checks that
+ * no writer changed it meanwhile: the metadata may be torn, so a location outside the
+ * ring is refused.
+ * @return the number of bytes copied, -EAGAIN for a location outside the ring (the bytes
+ * copied until then are not valid), -EFAULT when copy failed before the first byte
+ */
+
+ssize_t aesd_core_copy_history(struct aesd_circular_buffer *buffer, size_t pos,
+	size_t max_len, aesd_copy_fn copy, void *ctx)
+{
+	struct aesd_circular_buffer_cursor cursor;
+	struct aesd_ring_span span;
+	const char *ring_end = buffer->ring + buffer->ring_size;
+	size_t n_read = 0, to_read, copied;
+
+	if (!aesd_circular_buffer_cursor_init(buffer, &cursor, pos)) return 0;
+
+	while (n_read < max_len && aesd_circular_buffer_cursor_next(&cursor, max_len - n_read, &span)) {
+		if (span.ptr < buffer->ring || span.ptr >= ring_end
+			|| span.len > (size_t) (ring_end - span.ptr)) return -EAGAIN;
+
+		to_read = (span.len < max_len - n_read) ? span.len : max_len - n_read;
+
+		copied = copy(ctx, span.ptr, to_read);
+
+		n_read += copied;
+
+		if (copied < to_read) {
+			if (n_read == 0) return -EFAULT;
+			break;
+		}
+	}
+
+	return n_read;
+}
+
+/**
+ * Fills @param info with the boundaries of the oldest entries of @param buffer, @param max
+ * of them at most, numbered from @param first_seq (AESDCHAR_IOCGETENTRIES).
+ * Any necessary locking must be handled by the caller
+ * @return the number of elements filled
+ */
+
+uint32_t aesd_core_entries(struct aesd_circular_buffer *buffer, uint64_t first_seq,
+	struct aesd_entry_info *info, uint32_t max)
+{
+	struct aesd_buffer_entry *entry;
+	unsigned int i;
+
+	AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry, buffer, i) {
+		if (i == max) break;
+		info[i].seq = first_seq + i;
+		info[i].pos = entry->offs - buffer->base;
+		info[i].size = entry->size;
+	}
+
+	return i;
+}
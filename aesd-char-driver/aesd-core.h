@@ -0,0 +1,107 @@
+/*
+ * aesd-core.h
+ *
+ *  Data path of the aesdchar driver which does not depend on the kernel:
+ *  staging of write commands in chunk chains and their commit to the ring,
+ *  copies of the history and its entry table (AESDCHAR_IOCGETENTRIES).
+ *  main.c adds the locking and the copies from/to user space around it, and
+ *  provides the chunks and the history hooks through struct aesd_core_ops;
+ *  the same code builds in userspace for the benchmarks.
+ */
+
+#ifndef AESD_CHAR_DRIVER_AESD_CORE_H_
+#define AESD_CHAR_DRIVER_AESD_CORE_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#include <sys/types.h> // ssize_t
+#endif
+
+#include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
+
+/*
+ * Write commands are staged in a chain of fixed size chunks: partial writes
+ * append to the last chunk, nothing is copied again or reallocated while a
+ * command grows. Once the command is complete, aesd_core_commit copies it
+ * once into the byte ring, where the entry points, and the chunks are
+ * released for the next commands.
+ */
+#define AESD_CHUNK_SIZE 256
+
+struct aesd_chunk
+{
+	struct aesd_chunk *next;
+	size_t used;
+	char data[];
+};
+
+#define AESD_CHUNK_DATA (AESD_CHUNK_SIZE - sizeof(struct aesd_chunk))
+
+// command being written, not yet in the circular buffer
+struct aesd_working
+{
+	struct aesd_chunk *head;
+	struct aesd_chunk *tail;
+	size_t size;
+};
+
+// removes the oldest entry of the buffer for aesd_core_make_room
+typedef void (*aesd_evict_fn)(void *ctx);
+
+// copies len history bytes from src for aesd_core_copy_history, returns the
+// number of bytes copied (copy_to_iter in the module, memcpy in userspace)
+typedef size_t (*aesd_copy_fn)(void *ctx, const char *src, size_t len);
+
+/*
+ * Memory and history hooks of the staging and commit functions, called with
+ * the ctx given along with them
+ */
+struct aesd_core_ops
+{
+	// an empty chunk for aesd_core_stage_buffer, NULL when none is available
+	struct aesd_chunk *(*alloc)(void *ctx);
+	// gives back a chain of chunks, committed or dropped
+	void (*release)(void *ctx, struct aesd_chunk *chain);
+	// NULL to evict with aesd_circular_buffer_remove_entry
+	aesd_evict_fn evict;
+	// optional: around the changes of the buffer by aesd_core_commit, and
+	// once its entry was added (the newest one)
+	void (*change_begin)(void *ctx);
+	void (*change_end)(void *ctx);
+	void (*added)(void *ctx);
+};
+
+extern size_t aesd_core_command_len(const char *data, size_t n);
+
+extern void aesd_core_append_chunk(struct aesd_working *working, struct aesd_chunk *chunk);
+
+extern void aesd_core_splice(struct aesd_working *dst, struct aesd_working *src);
+
+extern struct aesd_chunk *aesd_core_next_command(struct aesd_working *batch, size_t *size);
+
+extern void aesd_core_copy_chain(char *dst, const struct aesd_chunk *head);
+
+extern char *aesd_core_make_room(struct aesd_circular_buffer *buffer, size_t size,
+	aesd_evict_fn evict, void *ctx);
+
+extern char *aesd_core_stage_buffer(struct aesd_working *working, size_t *room,
+	const struct aesd_core_ops *ops, void *ctx);
+
+extern int aesd_core_stage(struct aesd_working *working, struct aesd_working *batch,
+	size_t copied, size_t *used, size_t ring_size, const struct aesd_core_ops *ops, void *ctx);
+
+extern void aesd_core_commit(struct aesd_circular_buffer *buffer, struct aesd_working *orphan,
+	struct aesd_chunk *head, size_t size, const struct aesd_core_ops *ops, void *ctx);
+
+extern ssize_t aesd_core_copy_history(struct aesd_circular_buffer *buffer, size_t pos,
+	size_t max_len, aesd_copy_fn copy, void *ctx);
+
+extern uint32_t aesd_core_entries(struct aesd_circular_buffer *buffer, uint64_t first_seq,
+	struct aesd_entry_info *info, uint32_t max);
+
+#endif /* AESD_CHAR_DRIVER_AESD_CORE_H_ */
@@ -33,14 +33,202 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Usage of the history and eviction counters, returned by AESDCHAR_IOCGETSTATS
+ */
+struct aesd_stats {
+    /**
+     * Write commands and bytes currently held
+     */
+    uint64_t entries;
+    uint64_t bytes;
+    /**
+     * Limits: entry capacity and byte capacity (0 when not limited by bytes)
+     */
+    uint64_t capacity;
+    uint64_t max_bytes;
+    /**
+     * Write commands and bytes evicted since the module was loaded
+     */
+    uint64_t evicted_entries;
+    uint64_t evicted_bytes;
+    /**
+     * Storage chunks taken from the slab cache, returned to it, and reused
+     * from the free pool of the device (no allocator call), since the module
+     * was loaded; chunks currently in the free pool
+     */
+    uint64_t chunk_allocs;
+    uint64_t chunk_frees;
+    uint64_t chunks_recycled;
+    uint64_t pool_chunks;
+    /**
+     * Size of the byte ring holding the write commands, the largest command
+     * accepted
+     */
+    uint64_t ring_size;
+    /**
+     * Lockless reads restarted because a write changed the ring meanwhile,
+     * and reads which gave up and took the device lock
+     */
+    uint64_t read_retries;
+    uint64_t locked_reads;
+};
+
+/**
+ * Read-only mapping of the device (mmap from offset 0): this header, the
+ * entry table right after it (capacity elements, circular like the driver
+ * array: the oldest entry at out_offs), then the byte ring at ring_offset.
+ * seq is odd while the driver changes the history; a reader copies what it
+ * needs and starts again when seq was odd or changed meanwhile.
+ */
+struct aesd_mmap_header {
+    uint32_t seq;
+    uint32_t capacity;
+    uint32_t in_offs;
+    uint32_t out_offs;
+    uint32_t full;
+    uint32_t reserved;
+    /**
+     * Logical offset of the oldest byte, bytes in the history
+     */
+    uint64_t base;
+    uint64_t size;
+    /**
+     * Offsets from the start of the mapping, size of the ring
+     */
+    uint64_t table_offset;
+    uint64_t ring_offset;
+    uint64_t ring_size;
+};
+
+struct aesd_mmap_entry {
+    /**
+     * Logical offset of the first byte, position of the entry in the ring
+     * (entries never wrap) and size
+     */
+    uint64_t offs;
+    uint64_t ring_pos;
+    uint64_t size;
+};
+
+/**
+ * Boundaries of one write command, returned by AESDCHAR_IOCGETENTRIES
+ */
+struct aesd_entry_info {
+    /**
+     * Sequence number of the command, counted from the first command written
+     * since the module was loaded (evicted ones included)
+     */
+    uint64_t seq;
+    /**
+     * File position of its first byte at the time of the call (lseek or
+     * pread there) and size
+     */
+    uint64_t pos;
+    uint64_t size;
+};
+
+/**
+ * Argument of AESDCHAR_IOCGETENTRIES: the caller gives a table of max
+ * elements, the driver fills count of them from the oldest command on
+ */
+struct aesd_entries {
+    /**
+     * User address of the struct aesd_entry_info table, its capacity (in)
+     */
+    uint64_t table;
+    uint32_t max;
+    /**
+     * Elements filled, commands in the history (out): a table too small
+     * holds the oldest count commands only
+     */
+    uint32_t count;
+    uint32_t total;
+    uint32_t reserved;
+    /**
+     * Sequence number of the oldest command, logical offset of file
+     * position 0 (out)
+     */
+    uint64_t first_seq;
+    uint64_t base;
+};
+
+/**
+ * Buffer of AESDCHAR_IOCSNAPSHOT and AESDCHAR_IOCRESTORE: user address and
+ * size (in), snapshot size (out of AESDCHAR_IOCSNAPSHOT, also on ENOSPC)
+ */
+struct aesd_snapshot {
+    uint64_t buf;
+    uint64_t size;
+};
+
+/**
+ * Snapshot layout: this header, entries uint64_t sizes (oldest command
+ * first), the data_size bytes of the commands, then the pending bytes of a
+ * command not completed yet
+ */
+#define AESD_SNAPSHOT_MAGIC 0x44534541 // "AESD"
+#define AESD_SNAPSHOT_VERSION 1
+
+struct aesd_snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entries;
+    uint32_t reserved;
+    /**
+     * Logical offset of the oldest byte, sequence number of the oldest command
+     */
+    uint64_t base;
+    uint64_t first_seq;
+    uint64_t data_size;
+    uint64_t pending;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Set the number of write commands kept in the history (uint32_t), the
+ * oldest commands are dropped when shrinking
+ */
+#define AESDCHAR_IOCSETCAPACITY _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+/**
+ * Set the byte capacity of the history (uint64_t), 0 to limit the number of
+ * write commands only. The oldest commands are dropped until the rest fits.
+ */
+#define AESDCHAR_IOCSETMAXBYTES _IOW(AESD_IOC_MAGIC, 3, uint64_t)
+/**
+ * Read the usage and eviction counters (struct aesd_stats)
+ */
+#define AESDCHAR_IOCGETSTATS _IOR(AESD_IOC_MAGIC, 4, struct aesd_stats)
+/**
+ * Tail mode of the file (uint32_t, 0 or 1): a read at the end of the history
+ * waits for the next write command instead of returning 0
+ */
+#define AESDCHAR_IOCSETTAIL _IOW(AESD_IOC_MAGIC, 5, uint32_t)
+/**
+ * Boundaries of the write commands in the history (struct aesd_entries), all
+ * in one call
+ */
+#define AESDCHAR_IOCGETENTRIES _IOWR(AESD_IOC_MAGIC, 6, struct aesd_entries)
+/**
+ * Copy the history and the pending command to a buffer (struct aesd_snapshot)
+ */
+#define AESDCHAR_IOCSNAPSHOT _IOWR(AESD_IOC_MAGIC, 7, struct aesd_snapshot)
+/**
+ * Load a snapshot into the device, which must be empty (struct aesd_snapshot)
+ */
+#define AESDCHAR_IOCRESTORE _IOW(AESD_IOC_MAGIC, 8, struct aesd_snapshot)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 8
+
+/**
+ * Upper bound of AESDCHAR_IOCSETCAPACITY
+ */
+#define AESDCHAR_MAX_CAPACITY (1024 * 1024)
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,137 @@
+/*
+ * aesdchar-trace.h
+ *
+ *  Tracepoints of the aesdchar hot paths (events/aesdchar in tracefs), for
+ *  ftrace and perf. A disabled tracepoint costs a patched-out branch.
+ *
+ *  Every event records the minor of the device. Durations are in ns.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+// one pass over the history in read_iter (a tail reader may do several)
+TRACE_EVENT(aesd_read,
+	TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t result, u64 duration),
+	TP_ARGS(minor, pos, count, result, duration),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(ssize_t, result)
+		__field(u64, duration)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->result = result;
+		__entry->duration = duration;
+	),
+	TP_printk("minor=%u pos=%lld count=%zu result=%zd duration=%llu",
+		__entry->minor, __entry->pos, __entry->count, __entry->result,
+		__entry->duration)
+);
+
+// a write_iter call, pending: bytes of the command left incomplete
+TRACE_EVENT(aesd_write,
+	TP_PROTO(unsigned int minor, size_t count, ssize_t result, size_t pending, u64 duration),
+	TP_ARGS(minor, count, result, pending, duration),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(size_t, count)
+		__field(ssize_t, result)
+		__field(size_t, pending)
+		__field(u64, duration)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->result = result;
+		__entry->pending = pending;
+		__entry->duration = duration;
+	),
+	TP_printk("minor=%u count=%zu result=%zd pending=%zu duration=%llu",
+		__entry->minor, __entry->count, __entry->result, __entry->pending,
+		__entry->duration)
+);
+
+// commit and eviction of an entry, offs: logical offset of its first byte
+DECLARE_EVENT_CLASS(aesd_entry_class,
+	TP_PROTO(unsigned int minor, uint64_t offs, size_t size),
+	TP_ARGS(minor, offs, size),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(uint64_t, offs)
+		__field(size_t, size)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->offs = offs;
+		__entry->size = size;
+	),
+	TP_printk("minor=%u offs=%llu size=%zu",
+		__entry->minor, (unsigned long long) __entry->offs, __entry->size)
+);
+
+DEFINE_EVENT(aesd_entry_class, aesd_commit,
+	TP_PROTO(unsigned int minor, uint64_t offs, size_t size),
+	TP_ARGS(minor, offs, size)
+);
+
+DEFINE_EVENT(aesd_entry_class, aesd_evict,
+	TP_PROTO(unsigned int minor, uint64_t offs, size_t size),
+	TP_ARGS(minor, offs, size)
+);
+
+TRACE_EVENT(aesd_seek,
+	TP_PROTO(unsigned int minor, loff_t off, int whence, loff_t result),
+	TP_ARGS(minor, off, whence, result),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(loff_t, off)
+		__field(int, whence)
+		__field(loff_t, result)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->off = off;
+		__entry->whence = whence;
+		__entry->result = result;
+	),
+	TP_printk("minor=%u off=%lld whence=%d result=%lld",
+		__entry->minor, __entry->off, __entry->whence, __entry->result)
+);
+
+TRACE_EVENT(aesd_ioctl,
+	TP_PROTO(unsigned int minor, unsigned int cmd, long result, u64 duration),
+	TP_ARGS(minor, cmd, result, duration),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, nr)
+		__field(long, result)
+		__field(u64, duration)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->nr = _IOC_NR(cmd);
+		__entry->result = result;
+		__entry->duration = duration;
+	),
+	TP_printk("minor=%u nr=%u result=%ld duration=%llu",
+		__entry->minor, __entry->nr, __entry->result, __entry->duration)
+);
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+// outside the include guard, define_trace.h includes this file again
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar-trace
+#include <trace/define_trace.h>
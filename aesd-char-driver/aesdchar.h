@@ -6,14 +6,21 @@
  */
 
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
 
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd-core.h"
+#include "aesd_ioctl.h"
 
-#define AESD_DEBUG 1  
-// (above) Remove comment on this line to enable debug
+//#define AESD_DEBUG 1
+// (above) Remove comment on this line to enable debug, or build with DEBUG=y
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -28,6 +35,50 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+// upper bound of the nr_devices module parameter (minors of the region)
+#define AESD_MAX_DEVICES 64
+
+// chunks of evicted entries kept for the next writes (256 KiB), the rest go
+// back to the slab cache
+#define AESD_POOL_MAX_CHUNKS 1024
+
+// commands staged by a write call are committed by batches of this size
+#define AESD_STAGE_BATCH (64 * 1024)
+
+// latency buckets of the debugfs counters: < 1 us, < 2 us, < 4 us ..
+#define AESD_LAT_BUCKETS 16
+
+// counters shown in debugfs, updated without dev->lock
+struct aesd_counters
+{
+	atomic_long_t bytes_written;
+	atomic_long_t bytes_read;
+	atomic_long_t entries_committed;
+	// write calls leaving a command incomplete for a later write
+	atomic_long_t partial_writes;
+	// dev->lock found held by another task
+	atomic_long_t lock_contended;
+	atomic_long_t read_lat[AESD_LAT_BUCKETS];
+	atomic_long_t write_lat[AESD_LAT_BUCKETS];
+};
+
+// state of an open file, filp->private_data
+struct aesd_file
+{
+	struct aesd_dev *dev;
+
+	// command being written through this file, staged without dev->lock;
+	// the lock serializes the writers sharing the file
+	struct aesd_working working;
+	struct mutex lock;
+
+	// tail mode (AESDCHAR_IOCSETTAIL): reads at the end of the history wait
+	// for the next entry, and the position is followed as a logical offset
+	// (buffer base + f_pos) so that evictions do not move it
+	bool tail;
+	uint64_t tail_offs;
+};
+
 struct aesd_dev
 {
     /**
@@ -37,12 +88,51 @@ struct aesd_dev
 	// circular buffer
 	struct aesd_circular_buffer buffer;
 
-	// working buffer
-	struct aesd_buffer_entry working;
+	// partial command left by a closed file, completed by the next command
+	// committed on the device
+	struct aesd_working working;
+
+	// free chunks recycled from evicted entries, with the chunk counters of
+	// stats under pool_lock (writers allocate chunks without dev->lock)
+	struct aesd_chunk *pool;
+	unsigned int pool_count;
+	spinlock_t pool_lock;
 
-	// lock
+	// counters (usage gauges are filled in when read)
+	struct aesd_stats stats;
+
+	// lock, serializes the writers
 	struct mutex lock;
 
+	// readers copy from the ring without dev->lock: they check this
+	// sequence, bumped by writers around every change of the ring
+	seqcount_mutex_t seq;
+
+	// held for write while the entry array is replaced, lockless readers
+	// hold it for read so that the array they search stays allocated
+	struct rw_semaphore resize_sem;
+
+	// lockless reads which saw a concurrent write, reads done under dev->lock
+	atomic_long_t read_retries;
+	atomic_long_t locked_reads;
+
+	// debugfs counters
+	struct aesd_counters counters;
+
+	// woken up when an entry is committed (poll, tail reads)
+	wait_queue_head_t wait;
+
+	// storage shared with mmap: header, entry table, then buffer.ring
+	void *area;
+	struct aesd_mmap_header *mmap_header;
+	struct aesd_mmap_entry *mmap_table;
+
+	// live mappings of the area, it cannot be replaced meanwhile; no new
+	// mapping while frozen (the area is being replaced)
+	spinlock_t area_lock;
+	atomic_t mmap_count;
+	bool area_frozen;
+
 	// character device structure
     struct cdev cdev;     
 };
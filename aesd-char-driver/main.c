@@ -18,30 +18,466 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h> // file_operations
+#include <linux/mm.h> // kvcalloc, kvfree
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/version.h>
+#include <linux/uio.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "aesdchar-trace.h"
+
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+// ring capacity (number of entries), can be changed with AESDCHAR_IOCSETCAPACITY
+static unsigned int ring_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(ring_entries, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_entries, "Number of write commands kept in the history");
+
+// byte capacity, 0 = entry count only, can be changed with AESDCHAR_IOCSETMAXBYTES
+static unsigned long ring_bytes = 0;
+module_param(ring_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(ring_bytes, "Bytes kept in the history (0: limited by ring_entries only)");
+
+// size of the byte ring holding the committed write commands
+static unsigned long ring_size = 1024 * 1024;
+module_param(ring_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(ring_size, "Bytes of storage for the history, the largest write command accepted");
+
+// number of devices (minors), each one with its own ring and lock
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of aesdchar devices, /dev/aesdchar0 .. N-1");
+
+// lockless read attempts before a reader takes dev->lock
+#define AESD_READ_RETRIES 4
+
 MODULE_AUTHOR("Hyoun Cho"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices; // nr_devices of them
+
+// every chunk comes from this cache (fixed size, no fragmentation)
+static struct kmem_cache *aesd_chunk_cache;
+
+// debugfs directory of the counters, one file per device
+static struct dentry *aesd_debugfs_root;
+
+// minor of a device, in the trace events
+#define AESD_MINOR(d) MINOR((d)->cdev.dev)
+
+/**
+ * Takes a chunk from the free pool of the device, or from the slab cache when
+ * the pool is empty (with gfp: GFP_NOWAIT for a non-blocking writer, which
+ * holds dev->lock). Writers stage without dev->lock, the pool has its own.
+ */
+static struct aesd_chunk *aesd_chunk_alloc(struct aesd_dev *dev, gfp_t gfp)
+{
+	struct aesd_chunk *chunk;
+
+	spin_lock(&dev->pool_lock);
+
+	chunk = dev->pool;
+	if (chunk != NULL) {
+		dev->pool = chunk->next;
+		dev->pool_count--;
+		dev->stats.chunks_recycled++;
+	}
 
+	spin_unlock(&dev->pool_lock);
+
+	if (chunk == NULL) {
+		chunk = kmem_cache_alloc(aesd_chunk_cache, gfp);
+		if (chunk == NULL) return NULL;
+
+		spin_lock(&dev->pool_lock);
+		dev->stats.chunk_allocs++;
+		spin_unlock(&dev->pool_lock);
+	}
+
+	chunk->next = NULL;
+	chunk->used = 0;
+
+	return chunk;
+}
+
+// chunk for aesd_core_stage_buffer, a non-blocking writer does not wait for memory
+static struct aesd_chunk *aesd_chunk_get(void *ctx)
+{
+	return aesd_chunk_alloc(ctx, GFP_KERNEL);
+}
+
+static struct aesd_chunk *aesd_chunk_get_nowait(void *ctx)
+{
+	return aesd_chunk_alloc(ctx, GFP_NOWAIT);
+}
+
+/**
+ * Frees a chain of chunks to the slab cache
+ */
+static void aesd_chunks_free(struct aesd_chunk *chunk)
+{
+	struct aesd_chunk *next;
+
+	while (chunk != NULL) {
+		next = chunk->next;
+		kmem_cache_free(aesd_chunk_cache, chunk);
+		chunk = next;
+	}
+}
+
+/**
+ * Gives a chain of chunks back to the free pool, the chunks over
+ * AESD_POOL_MAX_CHUNKS go back to the slab cache
+ */
+static void aesd_chunks_release(void *ctx, struct aesd_chunk *chunk)
+{
+	struct aesd_dev *dev = ctx;
+	struct aesd_chunk *next, *excess = NULL;
+
+	spin_lock(&dev->pool_lock);
+
+	while (chunk != NULL) {
+		next = chunk->next;
+
+		if (dev->pool_count < AESD_POOL_MAX_CHUNKS) {
+			chunk->next = dev->pool;
+			dev->pool = chunk;
+			dev->pool_count++;
+		} else {
+			chunk->next = excess;
+			excess = chunk;
+			dev->stats.chunk_frees++;
+		}
+
+		chunk = next;
+	}
+
+	spin_unlock(&dev->pool_lock);
+
+	aesd_chunks_free(excess);
+}
+
+// bytes of the mmap header and entry table in front of the ring, whole pages
+static size_t aesd_meta_size(uint32_t capacity)
+{
+	return PAGE_ALIGN(sizeof(struct aesd_mmap_header)
+		+ (size_t) capacity * sizeof(struct aesd_mmap_entry));
+}
+
+/**
+ * Allocates the storage shared with mmap: header and entry table for capacity
+ * entries, then a ring of ring_size bytes
+ */
+static void *aesd_area_alloc(uint32_t capacity, size_t ring_size)
+{
+	struct aesd_mmap_header *header;
+
+	header = vmalloc_user(aesd_meta_size(capacity) + ring_size);
+	if (header == NULL) return NULL;
+
+	header->capacity = capacity;
+	header->table_offset = sizeof(struct aesd_mmap_header);
+	header->ring_offset = aesd_meta_size(capacity);
+	header->ring_size = ring_size;
+
+	return header;
+}
+
+// mirrors slot index of the entry array in the mapped table
+static void aesd_mmap_slot(struct aesd_dev *dev, unsigned int index)
+{
+	struct aesd_buffer_entry *entry = &dev->buffer.entry[index];
+	struct aesd_mmap_entry *slot = &dev->mmap_table[index];
+
+	slot->offs = entry->offs;
+	slot->ring_pos = (entry->buffptr != NULL) ? entry->buffptr - dev->buffer.ring : 0;
+	slot->size = entry->size;
+}
+
+// mirrors the buffer state in the mapped header
+static void aesd_mmap_state(struct aesd_dev *dev)
+{
+	struct aesd_mmap_header *header = dev->mmap_header;
+
+	header->in_offs = dev->buffer.in_offs;
+	header->out_offs = dev->buffer.out_offs;
+	header->full = dev->buffer.full;
+	header->base = dev->buffer.base;
+	header->size = dev->buffer.size;
+}
+
+/**
+ * Makes area the storage of the device: the ring content is copied over from
+ * the previous area, and the entry table mirrors the entry array, which must
+ * already have the capacity of area. dev->lock held, with neither lockless
+ * readers nor mappings.
+ * @return the previous area, to be released by the caller
+ */
+static void *aesd_area_install(struct aesd_dev *dev, void *area)
+{
+	struct aesd_mmap_header *header = area;
+	char *ring = (char *) area + header->ring_offset;
+	void *old = dev->area;
+	unsigned int i;
+
+	if (dev->buffer.ring != NULL) {
+		memcpy(ring, dev->buffer.ring, dev->buffer.ring_size);
+		aesd_circular_buffer_move_ring(&dev->buffer, ring);
+	} else {
+		dev->buffer.ring = ring;
+	}
+	dev->buffer.ring_size = header->ring_size;
+
+	dev->area = area;
+	dev->mmap_header = header;
+	dev->mmap_table = (struct aesd_mmap_entry *) ((char *) area + header->table_offset);
+
+	for (i = 0; i < dev->buffer.capacity; i++) {
+		aesd_mmap_slot(dev, i);
+	}
+	aesd_mmap_state(dev);
+
+	return old;
+}
+
+/**
+ * Starts a change of the history: lockless readers and readers of the mapping
+ * retry when they overlap it, dev->lock held
+ */
+static void aesd_change_begin(void *ctx)
+{
+	struct aesd_dev *dev = ctx;
+
+	write_seqcount_begin(&dev->seq);
+
+	WRITE_ONCE(dev->mmap_header->seq, dev->mmap_header->seq + 1);
+	smp_wmb();
+}
+
+static void aesd_change_end(void *ctx)
+{
+	struct aesd_dev *dev = ctx;
+
+	aesd_mmap_state(dev);
+
+	smp_wmb();
+	WRITE_ONCE(dev->mmap_header->seq, dev->mmap_header->seq + 1);
+
+	write_seqcount_end(&dev->seq);
+}
+
+/**
+ * Takes dev->lock, counting the times it was already held
+ */
+static int aesd_lock_interruptible(struct aesd_dev *dev)
+{
+	if (mutex_trylock(&dev->lock)) return 0;
+
+	atomic_long_inc(&dev->counters.lock_contended);
+
+	return mutex_lock_interruptible(&dev->lock);
+}
+
+/**
+ * dev->lock for a read or a write: a non-blocking caller (O_NONBLOCK or
+ * RWF_NOWAIT) gets -EAGAIN instead of sleeping when it is held
+ */
+static int aesd_lock_io(struct aesd_dev *dev, bool nonblock)
+{
+	if (!nonblock) return aesd_lock_interruptible(dev) ? -ERESTARTSYS : 0;
+
+	if (mutex_trylock(&dev->lock)) return 0;
+
+	atomic_long_inc(&dev->counters.lock_contended);
+
+	return -EAGAIN;
+}
+
+static bool aesd_nonblock(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static void aesd_lock(struct aesd_dev *dev)
+{
+	if (mutex_trylock(&dev->lock)) return;
+
+	atomic_long_inc(&dev->counters.lock_contended);
+
+	mutex_lock(&dev->lock);
+}
+
+/**
+ * Counts a call which started at start (ktime_get_ns) in its latency bucket:
+ * bucket 0 below 1 us, bucket i below 2^i us, the last one above. Returns
+ * the duration in ns.
+ */
+static u64 aesd_count_latency(atomic_long_t *buckets, u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+	u64 us = ns >> 10; // ~us, no division
+
+	atomic_long_inc(&buckets[us ? min_t(unsigned int, fls64(us), AESD_LAT_BUCKETS - 1) : 0]);
+
+	return ns;
+}
+
+/**
+ * Removes the oldest entry of the device, its ring bytes become free, dev->lock
+ * held and, unless resize_sem excludes the readers, between aesd_change_begin
+ * and aesd_change_end
+ */
+static void aesd_evict(void *ctx)
+{
+	struct aesd_dev *dev = ctx;
+	struct aesd_buffer_entry removed;
+	unsigned int index = dev->buffer.out_offs;
+
+	if (aesd_circular_buffer_remove_entry(&dev->buffer, &removed)) {
+		trace_aesd_evict(AESD_MINOR(dev), removed.offs, removed.size);
+		dev->stats.evicted_entries++;
+		dev->stats.evicted_bytes += removed.size;
+		aesd_mmap_slot(dev, index);
+	}
+}
+
+/**
+ * Evicts the oldest entries until an entry of size bytes fits (entry count,
+ * byte capacity, then ring space), returns where it goes in the ring.
+ * dev->lock held, between aesd_change_begin and aesd_change_end.
+ */
+static char *aesd_make_room(struct aesd_dev *dev, size_t size)
+{
+	return aesd_core_make_room(&dev->buffer, size, aesd_evict, dev);
+}
+
+/**
+ * Traces and maps the newest entry of the history, just added
+ */
+static void aesd_added(void *ctx)
+{
+	struct aesd_dev *dev = ctx;
+	unsigned int index = (dev->buffer.in_offs + dev->buffer.capacity - 1) % dev->buffer.capacity;
+
+	trace_aesd_commit(AESD_MINOR(dev), dev->buffer.entry[index].offs, dev->buffer.entry[index].size);
+	aesd_mmap_slot(dev, index);
+
+	atomic_long_inc(&dev->counters.entries_committed);
+}
+
+/**
+ * Adds the entry copied to dst (from aesd_make_room) to the history
+ */
+static void aesd_add(struct aesd_dev *dev, char *dst, size_t size)
+{
+	struct aesd_buffer_entry entry;
+
+	entry.buffptr = dst;
+	entry.size = size;
+
+	aesd_circular_buffer_add_entry(&dev->buffer, &entry);
+	aesd_added(dev);
+}
+
+/*
+ * Staging and commit of the write path (aesd-core.c): chunks from the pool of
+ * the device, and every commit between aesd_change_begin and aesd_change_end
+ * so that lockless readers retry if they overlapped it
+ */
+static const struct aesd_core_ops aesd_core_ops = {
+	.alloc = aesd_chunk_get,
+	.release = aesd_chunks_release,
+	.evict = aesd_evict,
+	.change_begin = aesd_change_begin,
+	.change_end = aesd_change_end,
+	.added = aesd_added,
+};
+
+static const struct aesd_core_ops aesd_core_ops_nowait = {
+	.alloc = aesd_chunk_get_nowait,
+	.release = aesd_chunks_release,
+	.evict = aesd_evict,
+	.change_begin = aesd_change_begin,
+	.change_end = aesd_change_end,
+	.added = aesd_added,
+};
+
+/**
+ * Commits the commands staged by a write call under one dev->lock acquisition
+ * (already held when locked, for a non-blocking writer). Every command ends
+ * with the chunk holding its newline, the next one starts in a fresh chunk.
+ * The partial command a closed file left in dev->working goes in front of the
+ * first one. The tail readers are woken up once done.
+ */
+static void aesd_commit_batch(struct aesd_dev *dev, struct aesd_working *batch, bool locked)
+{
+	struct aesd_chunk *head;
+	size_t size;
+
+	if (!locked) aesd_lock(dev);
+
+	while ((head = aesd_core_next_command(batch, &size)) != NULL) {
+		aesd_core_commit(&dev->buffer, &dev->working, head, size, &aesd_core_ops, dev);
+	}
+
+	if (!locked) mutex_unlock(&dev->lock);
+
+	wake_up_interruptible(&dev->wait);
+}
+
+/**
+ * Logical offset following the newest byte of the history, without dev->lock
+ */
+static uint64_t aesd_history_end(struct aesd_dev *dev)
+{
+	unsigned int seq;
+	uint64_t end;
+
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		end = dev->buffer.base + dev->buffer.size;
+	} while (read_seqcount_retry(&dev->seq, seq));
+
+	return end;
+}
+
+/**
+ * File position of a tail mode reader: its logical offset, or the oldest byte
+ * when the entries it had not read yet were evicted
+ */
+static loff_t aesd_tail_fpos(struct aesd_dev *dev, struct aesd_file *af)
+{
+	return (af->tail_offs > dev->buffer.base) ? af->tail_offs - dev->buffer.base : 0;
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
-	struct aesd_dev *dev;
+	struct aesd_file *af;
 
     PDEBUG("OPEN");
 
     /* TODO: handle open */
 
-	dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+	af = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+	if (af == NULL) return -ENOMEM;
+
+	af->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+	mutex_init(&af->lock);
 
-	filp->private_data = dev;
+	filp->private_data = af;
+
+	// RWF_NOWAIT reads and writes are refused by the VFS unless the file
+	// says it can fail them with -EAGAIN (see aesd_nonblock)
+	filp->f_mode |= FMODE_NOWAIT;
 
 	/* TODO-END */
 
@@ -50,123 +486,267 @@ int aesd_open(struct inode *inode, struct file *filp)
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+	struct aesd_file *af;
+	struct aesd_dev *dev;
+
     PDEBUG("RELEASE");
 
     /* TODO: handle release */
+
+	af = (struct aesd_file *) filp->private_data;
+	dev = af->dev;
+
+	// a partial command is completed by the next write on the device
+	if (af->working.head != NULL) {
+		aesd_lock(dev);
+		aesd_core_splice(&dev->working, &af->working);
+		mutex_unlock(&dev->lock);
+	}
+
+	mutex_destroy(&af->lock);
+	kfree(af);
+
 	/* TODO-END */
 
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+// copy callback of aesd_core_copy_history, ctx is the iov_iter
+static size_t aesd_copy_to_iter(void *ctx, const char *src, size_t len)
 {
-    //ssize_t retval = 0;
-	struct aesd_dev *dev;
-	struct aesd_buffer_entry *entry;
-	ssize_t read_offs;
-	ssize_t  n_read, not_copied, to_read, just_copied, search_offset;
-	int i; 
-
-    PDEBUG("READ >>  %zu bytes with offset %lld, f_pos=%lld", count, *f_pos, filp->f_pos);
+	return copy_to_iter(src, len, ctx);
+}
 
-    /* TODO: handle read  */
+/**
+ * Copies the history from pos on to the iterator (aesd_core_copy_history).
+ * Called with dev->lock held, or without it inside a read section of
+ * dev->seq: the ring metadata may then be torn by a writer, locations
+ * outside the ring are refused with -EAGAIN and the caller checks the
+ * sequence before using the result.
+ */
+static ssize_t aesd_copy_history(struct aesd_dev *dev, struct iov_iter *to, loff_t pos)
+{
+	size_t count = iov_iter_count(to);
+	ssize_t n_read;
 
-	if (filp == NULL) return -EFAULT;
+	n_read = aesd_core_copy_history(&dev->buffer, pos, count, aesd_copy_to_iter, to);
 
-	dev = (struct aesd_dev*) filp->private_data; // circular buffer
+	// nothing is kept from a torn copy
+	if (n_read == -EAGAIN) iov_iter_revert(to, count - iov_iter_count(to));
 
-	if (dev == NULL) return -EFAULT;
+	return n_read;
+}
 
-	if (mutex_lock_interruptible(&dev->lock)) {
+/**
+ * Reads from the file position, or from the logical offset of a tail mode
+ * reader, without waiting for data. A non-blocking reader does not wait for
+ * the locks either (-EAGAIN).
+ */
+static ssize_t aesd_read_history(struct aesd_file *af, struct iov_iter *to, loff_t *f_pos,
+	bool nonblock)
+{
+	struct aesd_dev *dev = af->dev;
+	ssize_t n_read = -EAGAIN;
+	unsigned int seq, tries;
+	uint64_t base = 0;
+	loff_t pos = 0;
+	int result;
+
+	if (nonblock) {
+		if (!down_read_trylock(&dev->resize_sem)) return -EAGAIN;
+	} else if (down_read_killable(&dev->resize_sem)) {
 		return -ERESTARTSYS;
 	}
 
-	// return the most recent 10 write commands 
-	search_offset = *f_pos; 
-	n_read = 0;
+	// readers run alongside each other and alongside the writers, the copy is
+	// redone when a write changed the ring meanwhile
+	for (tries = 0; tries < AESD_READ_RETRIES; tries++) {
+		seq = read_seqcount_begin(&dev->seq);
 
-	for (i=0; i < 10; i++) {
+		base = dev->buffer.base;
+		pos = af->tail ? aesd_tail_fpos(dev, af) : *f_pos;
+		n_read = aesd_copy_history(dev, to, pos);
 
-		entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, search_offset, &read_offs);
+		if (!read_seqcount_retry(&dev->seq, seq)) break;
 
-		if (entry == NULL) break;
+		// the destination is filled again from the same point
+		if (n_read > 0) iov_iter_revert(to, n_read);
 
-		to_read = entry->size - read_offs;    // rest of the content in the buffer
-		if (to_read > count) to_read = count; // read partial
-	
-		not_copied = copy_to_user(buf + n_read, entry->buffptr + read_offs, to_read);
+		atomic_long_inc(&dev->read_retries);
+		n_read = -EAGAIN;
+	}
 
-		just_copied = to_read - not_copied;
+	// writers keep changing the ring: read under the lock instead
+	if (n_read == -EAGAIN) {
+		result = aesd_lock_io(dev, nonblock);
+		if (result) {
+			up_read(&dev->resize_sem);
+			return result;
+		}
 
-		n_read += just_copied;
-		count -= just_copied;
-		search_offset += just_copied;
+		atomic_long_inc(&dev->locked_reads);
+		base = dev->buffer.base;
+		pos = af->tail ? aesd_tail_fpos(dev, af) : *f_pos;
+		n_read = aesd_copy_history(dev, to, pos);
 
-		if (count == 0) break;
+		mutex_unlock(&dev->lock);
 	}
 
-	*f_pos += n_read;
-
-	// end of mutex
-	mutex_unlock(&dev->lock);
+	up_read(&dev->resize_sem);
 
-	//printk(KERN_ALERT "Total Read = %d", n_read);
+	if (n_read > 0) {
+		*f_pos = pos + n_read;
+		if (af->tail) af->tail_offs = base + *f_pos;
+	}
 
 	return n_read;
+}
 
-	/* TODO-END */
+/**
+ * read(), readv() and splice (sendfile) all come here: the iterator is a user
+ * buffer, or pipe pages for splice_read
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct aesd_file *af;
+	ssize_t n_read;
+	size_t count;
+	loff_t pos;
+	u64 start, ns;
+	bool nonblock = aesd_nonblock(iocb);
+
+    PDEBUG("READ >>  %zu bytes with offset %lld, f_pos=%lld", iov_iter_count(to), iocb->ki_pos, filp->f_pos);
+
+	af = (struct aesd_file *) filp->private_data;
+
+	if (af == NULL) return -EFAULT;
+
+	// at the end of the history, a tail mode reader waits for the next entry
+	for (;;) {
+		start = ktime_get_ns();
+		pos = iocb->ki_pos;
+		count = iov_iter_count(to);
+
+		n_read = aesd_read_history(af, to, &iocb->ki_pos, nonblock);
+
+		ns = aesd_count_latency(af->dev->counters.read_lat, start);
+		trace_aesd_read(AESD_MINOR(af->dev), pos, count, n_read, ns);
+
+		if (n_read != 0 || !af->tail || iov_iter_count(to) == 0) break;
+
+		// nothing new yet, poll tells when
+		if (nonblock) return -EAGAIN;
+
+		if (wait_event_interruptible(af->dev->wait, aesd_history_end(af->dev) > af->tail_offs)) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	if (n_read > 0) atomic_long_add(n_read, &af->dev->counters.bytes_read);
+
+	return n_read;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * write() and writev() come here. The data is staged in the chunks of the
+ * file without dev->lock; every newline ends a command, and the commands of
+ * the call are committed to the ring under one dev->lock acquisition (every
+ * AESD_STAGE_BATCH bytes for large calls). Bytes after the last newline stay
+ * staged in the file for its next write.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
     //ssize_t retval = -ENOMEM;
+	struct aesd_file *af;
 	struct aesd_dev *dev;
-	int rc;
-	ssize_t n_written;
-
-    PDEBUG("WRITE >>  %zu bytes with offset %lld",count,*f_pos);
+	struct aesd_working *working, batch = { NULL, NULL, 0 };
+	size_t done = 0, staged = 0, len, room, copied, used;
+	ssize_t n_written = 0;
+	char *dst;
+	size_t count = iov_iter_count(from), pending;
+	u64 start = ktime_get_ns(), ns;
+	bool nonblock = aesd_nonblock(iocb);
+	const struct aesd_core_ops *ops = nonblock ? &aesd_core_ops_nowait : &aesd_core_ops;
+	int result;
+
+    PDEBUG("WRITE >>  %zu bytes with offset %lld", iov_iter_count(from), iocb->ki_pos);
 
     /* TODO: handle write */
 
-	if (filp == NULL) return -EFAULT;
+	af = (struct aesd_file *) iocb->ki_filp->private_data;
+	dev = af->dev;
 
-	dev = (struct aesd_dev*) filp->private_data; // circular buffer
+	// writers sharing the file take turns, other files are not held up. A
+	// non-blocking writer takes both locks up front or fails, staging then
+	// happens under dev->lock so that the commit cannot block either.
+	if (nonblock) {
+		if (!mutex_trylock(&af->lock)) return -EAGAIN;
 
-	if (mutex_lock_interruptible(&dev->lock)) {
+		result = aesd_lock_io(dev, true);
+		if (result) {
+			mutex_unlock(&af->lock);
+			return result;
+		}
+	} else if (mutex_lock_interruptible(&af->lock)) {
 		return -ERESTARTSYS;
 	}
 
-	if (dev->working.size == 0) {
-		dev->working.buffptr = (char *) kmalloc(count, GFP_KERNEL);
-	} else {
-		dev->working.buffptr = (char *) krealloc(dev->working.buffptr, dev->working.size + count, GFP_KERNEL);
-	}
-	
-	if (dev->working.buffptr == NULL) {
-		n_written = -ENOMEM;
-	} else {
-		rc = copy_from_user((void *) (dev->working.buffptr + dev->working.size), buf, count);
-		n_written = count - rc;	
+	working = &af->working;
 
-		dev->working.size += n_written;
+	// append to the last chunk, chaining a new one when it is full
+	while (iov_iter_count(from) > 0) {
+		dst = aesd_core_stage_buffer(working, &room, ops, dev);
+		if (dst == NULL) {
+			n_written = nonblock ? -EAGAIN : -ENOMEM;
+			break;
+		}
 
-		// if there is '\n',
-		if (dev->working.buffptr[dev->working.size-1] == '\n') {
+		len = min(iov_iter_count(from), room);
 
-			if (dev->buffer.full) {
-				kfree(dev->buffer.entry[dev->buffer.out_offs].buffptr);
-			}
+		copied = copy_from_iter(dst, len, from);
 
-			aesd_circular_buffer_add_entry(&dev->buffer, &dev->working);
+		// the bytes past a newline start the next command, copied again then
+		result = aesd_core_stage(working, &batch, copied, &used, dev->buffer.ring_size, ops, dev);
+		if (used < copied) iov_iter_revert(from, copied - used);
 
-			dev->working.buffptr = NULL;
-			dev->working.size = 0;
+		// a command larger than the ring could never be stored, it was dropped
+		if (result == -EFBIG) {
+			n_written = -EFBIG;
+			done = staged;
+			break;
+		}
+
+		done += used;
+
+		// if there is '\n', the command joined the batch going to the ring
+		if (result > 0) {
+			staged = done;
+
+			if (batch.size >= AESD_STAGE_BATCH) aesd_commit_batch(dev, &batch, nonblock);
+		} else if (used < len) {
+			n_written = -EFAULT;
+			break;
 		}
 	}
-	
-	mutex_unlock(&dev->lock);
+
+	if (batch.head != NULL) aesd_commit_batch(dev, &batch, nonblock);
+
+	if (nonblock) mutex_unlock(&dev->lock);
+
+	// the call left a command to be completed by a later write
+	if (working->size > 0 && done > staged) atomic_long_inc(&dev->counters.partial_writes);
+	pending = working->size;
+
+	mutex_unlock(&af->lock);
+
+	// bytes accepted take precedence over the error
+	if (done > 0) n_written = done;
+
+	if (done > 0) atomic_long_add(done, &dev->counters.bytes_written);
+	ns = aesd_count_latency(dev->counters.write_lat, start);
+	trace_aesd_write(AESD_MINOR(dev), count, n_written, pending, ns);
+
 	return n_written; // can be error value too
 
 	/* TODO-END */
@@ -174,6 +754,7 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 
 loff_t aesd_seek(struct file *filp, loff_t off, int whence)
 {
+	struct aesd_file *af;
 	struct aesd_dev *dev;
 	loff_t newpos;
 
@@ -181,36 +762,453 @@ loff_t aesd_seek(struct file *filp, loff_t off, int whence)
 
 	if (filp == NULL) return -EFAULT;
 
-	dev = (struct aesd_dev*) filp->private_data; 
+	af = (struct aesd_file *) filp->private_data;
+	dev = af->dev;
 
-	if (mutex_lock_interruptible(&dev->lock)) {
+	if (aesd_lock_interruptible(dev)) {
 	    return -ERESTARTSYS;
 	}
 
+	// a tail mode reader seeks from where it actually is
+	if (af->tail) filp->f_pos = aesd_tail_fpos(dev, af);
+
 	newpos = fixed_size_llseek(filp, off, whence, dev->buffer.size);
 
 	PDEBUG("SEEK > new pos=%lld", newpos);
 
-	if (newpos < 0) return -EINVAL;
+	if (newpos >= 0) {
+		filp->f_pos = newpos;
+		af->tail_offs = dev->buffer.base + newpos;
+	}
+
+	mutex_unlock(&dev->lock);
+
+	trace_aesd_seek(AESD_MINOR(dev), off, whence, newpos);
+
+	return (newpos < 0) ? -EINVAL : newpos;
+}
+
+__poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct aesd_file *af = (struct aesd_file *) filp->private_data;
+	struct aesd_dev *dev = af->dev;
+	// writes never wait for readers; a non-blocking write can still meet
+	// dev->lock held for a moment (commit, locked read) and get -EAGAIN
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+	unsigned int seq;
+	uint64_t pos, end;
+
+	poll_wait(filp, &dev->wait, wait);
+
+	// readable when a read would return data right away
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		pos = af->tail ? af->tail_offs : dev->buffer.base + filp->f_pos;
+		end = dev->buffer.base + dev->buffer.size;
+	} while (read_seqcount_retry(&dev->seq, seq));
+
+	if (end > pos) mask |= EPOLLIN | EPOLLRDNORM;
+
+	return mask;
+}
 
-	filp->f_pos = newpos;
+/**
+ * Replaces the entry array of the device by one of capacity entries, the
+ * oldest entries which do not fit are freed. The mapped storage is replaced
+ * too (the entry table grows with the array): -EBUSY while the device is
+ * mapped.
+ */
+static int aesd_set_capacity(struct aesd_dev *dev, uint32_t capacity)
+{
+	struct aesd_buffer_entry *entries;
+	void *area;
+	int result = 0;
+
+	if (capacity == 0 || capacity > AESDCHAR_MAX_CAPACITY) return -EINVAL;
+
+	// allocate before locking, readers and writers are not held up
+	entries = kvcalloc(capacity, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+	area = aesd_area_alloc(capacity, dev->buffer.ring_size);
+	if (entries == NULL || area == NULL) {
+		kvfree(entries);
+		vfree(area);
+		return -ENOMEM;
+	}
+
+	// lockless readers must not search the array while it is replaced
+	if (down_write_killable(&dev->resize_sem)) {
+		kvfree(entries);
+		vfree(area);
+		return -ERESTARTSYS;
+	}
+
+	if (aesd_lock_interruptible(dev)) {
+		up_write(&dev->resize_sem);
+		kvfree(entries);
+		vfree(area);
+		return -ERESTARTSYS;
+	}
+
+	// no new mapping of the old area from now on
+	spin_lock(&dev->area_lock);
+	if (atomic_read(&dev->mmap_count) > 0) {
+		result = -EBUSY;
+	} else {
+		dev->area_frozen = true;
+	}
+	spin_unlock(&dev->area_lock);
+
+	if (result == 0) {
+		while (aesd_circular_buffer_count(&dev->buffer) > capacity) {
+			aesd_evict(dev);
+		}
+
+		entries = aesd_circular_buffer_resize(&dev->buffer, entries, capacity);
+		area = aesd_area_install(dev, area);
+
+		spin_lock(&dev->area_lock);
+		dev->area_frozen = false;
+		spin_unlock(&dev->area_lock);
+	}
 
 	mutex_unlock(&dev->lock);
+	up_write(&dev->resize_sem);
+
+	kvfree(entries); // previous array (kvfree ignores NULL), or the unused one
+	vfree(area);
 
-	return newpos;
+	PDEBUG("IOCTL >> capacity=%u", capacity);
+
+	return result;
 }
 
-long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/**
+ * Sets the byte capacity of the device, 0 to disable, evicting the oldest
+ * entries until the rest fits
+ */
+static int aesd_set_max_bytes(struct aesd_dev *dev, uint64_t max_bytes)
+{
+	if (max_bytes > SIZE_MAX) return -EINVAL;
+
+	if (aesd_lock_interruptible(dev)) {
+		return -ERESTARTSYS;
+	}
+
+	aesd_change_begin(dev);
+
+	dev->buffer.max_bytes = max_bytes;
+
+	while (max_bytes > 0 && dev->buffer.size > max_bytes) {
+		aesd_evict(dev);
+	}
+
+	aesd_change_end(dev);
+
+	mutex_unlock(&dev->lock);
+
+	PDEBUG("IOCTL >> max_bytes=%llu", max_bytes);
+
+	return 0;
+}
+
+/**
+ * AESDCHAR_IOCGETENTRIES: the table is built in a kernel buffer under
+ * dev->lock, then copied to the user in one go once the lock is dropped
+ */
+static long aesd_get_entries(struct aesd_dev *dev, struct aesd_entries __user *uarg)
 {
+	struct aesd_entries req;
+	struct aesd_entry_info *info = NULL;
+	uint32_t n;
+	long result = 0;
+
+	if (copy_from_user(&req, uarg, sizeof(req))) return -EFAULT;
+
+	// no more than the history can hold, the capacity may change meanwhile
+	n = min(req.max, READ_ONCE(dev->buffer.capacity));
+	if (n > 0) {
+		info = kvmalloc_array(n, sizeof(struct aesd_entry_info), GFP_KERNEL);
+		if (info == NULL) return -ENOMEM;
+	}
+
+	if (aesd_lock_interruptible(dev)) {
+		kvfree(info);
+		return -ERESTARTSYS;
+	}
+
+	req.total = aesd_circular_buffer_count(&dev->buffer);
+	req.first_seq = dev->stats.evicted_entries; // every removal is an eviction
+	req.base = dev->buffer.base;
+	req.count = aesd_core_entries(&dev->buffer, req.first_seq, info, n);
+
+	mutex_unlock(&dev->lock);
+
+	if (req.count > 0 && copy_to_user(u64_to_user_ptr(req.table), info,
+			(size_t) req.count * sizeof(struct aesd_entry_info))) {
+		result = -EFAULT;
+	} else if (copy_to_user(uarg, &req, sizeof(req))) {
+		result = -EFAULT;
+	}
+
+	kvfree(info);
+
+	return result;
+}
+
+/**
+ * AESDCHAR_IOCSNAPSHOT: writes the snapshot (struct aesd_snapshot_header,
+ * entry sizes, history bytes, pending bytes) straight from the ring to the
+ * user buffer under dev->lock. The history is contiguous in the ring, two
+ * copies at most. -ENOSPC when the buffer is too small, the size needed is
+ * returned in both cases.
+ */
+static long aesd_save_snapshot(struct aesd_dev *dev, struct aesd_snapshot __user *uarg)
+{
+	struct aesd_snapshot req;
+	struct aesd_snapshot_header *hdr;
+	struct aesd_buffer_entry *entry;
+	struct aesd_circular_buffer_cursor cursor;
+	struct aesd_ring_span span;
+	struct aesd_chunk *chunk;
+	uint64_t *sizes;
+	char __user *dst;
+	size_t meta, need = 0;
+	uint32_t i, n;
+	long result = 0;
+
+	if (copy_from_user(&req, uarg, sizeof(req))) return -EFAULT;
+
+	if (aesd_lock_interruptible(dev)) return -ERESTARTSYS;
+
+	n = aesd_circular_buffer_count(&dev->buffer);
+	meta = sizeof(struct aesd_snapshot_header) + (size_t) n * sizeof(uint64_t);
+	need = meta + dev->buffer.size + dev->working.size;
+
+	if (req.size < need) {
+		result = -ENOSPC;
+		goto out;
+	}
+
+	hdr = kvmalloc(meta, GFP_KERNEL);
+	if (hdr == NULL) {
+		result = -ENOMEM;
+		goto out;
+	}
+
+	hdr->magic = AESD_SNAPSHOT_MAGIC;
+	hdr->version = AESD_SNAPSHOT_VERSION;
+	hdr->entries = n;
+	hdr->reserved = 0;
+	hdr->base = dev->buffer.base;
+	hdr->first_seq = dev->stats.evicted_entries;
+	hdr->data_size = dev->buffer.size;
+	hdr->pending = dev->working.size;
+
+	sizes = (uint64_t *) (hdr + 1);
+	AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry, &dev->buffer, i) {
+		sizes[i] = entry->size;
+	}
+
+	dst = u64_to_user_ptr(req.buf);
+	if (copy_to_user(dst, hdr, meta)) result = -EFAULT;
+	dst += meta;
+
+	kvfree(hdr);
+
+	if (result == 0) {
+		aesd_circular_buffer_cursor_init(&dev->buffer, &cursor, 0);
+
+		while (result == 0 && aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span)) {
+			if (copy_to_user(dst, span.ptr, span.len)) result = -EFAULT;
+			dst += span.len;
+		}
+	}
+
+	for (chunk = dev->working.head; chunk != NULL && result == 0; chunk = chunk->next) {
+		if (copy_to_user(dst, chunk->data, chunk->used)) result = -EFAULT;
+		dst += chunk->used;
+	}
+
+out:
+	mutex_unlock(&dev->lock);
+
+	req.size = need;
+	if ((result == 0 || result == -ENOSPC) && copy_to_user(uarg, &req, sizeof(req))) {
+		result = -EFAULT;
+	}
+
+	return result;
+}
+
+/**
+ * AESDCHAR_IOCRESTORE: loads a snapshot into an empty device (-EBUSY
+ * otherwise), keeping its logical offsets and sequence numbers. The snapshot
+ * is copied and checked before taking dev->lock; commands over the capacity
+ * of the device are dropped, oldest first.
+ */
+static long aesd_restore_snapshot(struct aesd_dev *dev, struct aesd_snapshot __user *uarg)
+{
+	struct aesd_snapshot req;
+	struct aesd_snapshot_header *hdr;
+	struct aesd_working pending = { NULL, NULL, 0 };
+	struct aesd_chunk *chunk;
+	const uint64_t *sizes;
+	const char *data, *p;
+	uint64_t total = 0, base, first_seq;
+	size_t meta, len, ring_size = dev->buffer.ring_size;
+	uint32_t i, skip;
+	char *dst;
+	long result = 0;
+
+	if (copy_from_user(&req, uarg, sizeof(req))) return -EFAULT;
+
+	// header, entry table, history and pending bytes, none larger than the ring
+	if (req.size < sizeof(struct aesd_snapshot_header)
+		|| req.size > sizeof(struct aesd_snapshot_header)
+			+ AESDCHAR_MAX_CAPACITY * sizeof(uint64_t) + 2 * (uint64_t) ring_size) {
+		return -EINVAL;
+	}
+
+	hdr = kvmalloc(req.size, GFP_KERNEL);
+	if (hdr == NULL) return -ENOMEM;
+
+	if (copy_from_user(hdr, u64_to_user_ptr(req.buf), req.size)) {
+		result = -EFAULT;
+		goto out;
+	}
+
+	meta = sizeof(struct aesd_snapshot_header) + (size_t) hdr->entries * sizeof(uint64_t);
+	sizes = (const uint64_t *) (hdr + 1);
+
+	if (hdr->magic != AESD_SNAPSHOT_MAGIC || hdr->version != AESD_SNAPSHOT_VERSION
+		|| hdr->entries > AESDCHAR_MAX_CAPACITY || hdr->data_size > ring_size
+		|| hdr->pending > ring_size || meta + hdr->data_size + hdr->pending != req.size) {
+		result = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0; i < hdr->entries; i++) {
+		if (sizes[i] == 0 || sizes[i] > ring_size) break;
+		total += sizes[i];
+	}
+
+	if (i < hdr->entries || total != hdr->data_size) {
+		result = -EINVAL;
+		goto out;
+	}
+
+	data = (const char *) hdr + meta;
+
+	// the pending bytes go back to chunks, allocated before locking
+	for (p = data + hdr->data_size; p < data + hdr->data_size + hdr->pending; p += len) {
+		chunk = aesd_chunk_alloc(dev, GFP_KERNEL);
+		if (chunk == NULL) {
+			result = -ENOMEM;
+			goto out;
+		}
+
+		len = min_t(size_t, data + hdr->data_size + hdr->pending - p, AESD_CHUNK_DATA);
+		memcpy(chunk->data, p, len);
+		chunk->used = len;
+
+		aesd_core_append_chunk(&pending, chunk);
+	}
+
+	if (aesd_lock_interruptible(dev)) {
+		result = -ERESTARTSYS;
+		goto out;
+	}
+
+	if (aesd_circular_buffer_count(&dev->buffer) > 0 || dev->working.head != NULL) {
+		mutex_unlock(&dev->lock);
+		result = -EBUSY;
+		goto out;
+	}
+
+	// the oldest commands beyond the capacity of the device are dropped
+	skip = (hdr->entries > dev->buffer.capacity) ? hdr->entries - dev->buffer.capacity : 0;
+	base = hdr->base;
+	first_seq = hdr->first_seq + skip;
+	for (i = 0; i < skip; i++) {
+		base += sizes[i];
+		data += sizes[i];
+	}
+
+	aesd_change_begin(dev);
+
+	// empty history: it starts at the logical offset of the snapshot
+	dev->buffer.base = base;
+	dev->stats.evicted_entries = first_seq;
+
+	for (i = skip; i < hdr->entries; i++) {
+		dst = aesd_make_room(dev, sizes[i]);
+		memcpy(dst, data, sizes[i]);
+		aesd_add(dev, dst, sizes[i]);
+		data += sizes[i];
+	}
+
+	aesd_change_end(dev);
+
+	dev->working = pending;
+	pending.head = NULL;
+
+	mutex_unlock(&dev->lock);
+
+	wake_up_interruptible(&dev->wait);
+
+	PDEBUG("IOCTL >> restored %u entries", hdr->entries - skip);
+
+out:
+	aesd_chunks_release(dev, pending.head);
+	kvfree(hdr);
+
+	return result;
+}
+
+static long aesd_ioctl_cmd(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct aesd_file *af;
 	struct aesd_dev *dev;
 	struct aesd_seekto cmd_arg;
-	int result, rc, pos, i;
+	int result, rc;
+	size_t pos;
+	uint32_t capacity, tail;
+	uint64_t max_bytes;
+	struct aesd_stats stats;
 
 	//PDEBUG("ioctl command=%zu, arg=%lld", cmd, arg);
 
-	dev = (struct aesd_dev*) filp->private_data;
+	af = (struct aesd_file *) filp->private_data;
+	dev = af->dev;
+
+	if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR) {
+		return -ENOTTY;
+	}
+
+	// commands handling their own locking
+	if (cmd == AESDCHAR_IOCSETCAPACITY) {
+		if (get_user(capacity, (uint32_t __user *) arg)) return -EFAULT;
+		return aesd_set_capacity(dev, capacity);
+	}
+
+	if (cmd == AESDCHAR_IOCSETMAXBYTES) {
+		if (copy_from_user(&max_bytes, (const void __user *) arg, sizeof(max_bytes))) return -EFAULT;
+		return aesd_set_max_bytes(dev, max_bytes);
+	}
+
+	if (cmd == AESDCHAR_IOCGETENTRIES) {
+		return aesd_get_entries(dev, (struct aesd_entries __user *) arg);
+	}
+
+	if (cmd == AESDCHAR_IOCSNAPSHOT) {
+		return aesd_save_snapshot(dev, (struct aesd_snapshot __user *) arg);
+	}
 
-	if (mutex_lock_interruptible(&dev->lock)) {
+	if (cmd == AESDCHAR_IOCRESTORE) {
+		return aesd_restore_snapshot(dev, (struct aesd_snapshot __user *) arg);
+	}
+
+	if (aesd_lock_interruptible(dev)) {
 		return -ERESTARTSYS;
 	}
 
@@ -223,23 +1221,16 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			if (rc != 0) {
 				result = -EFAULT;
 			} else {
-				// cmd_arg.write_cmd -> command
+				// cmd_arg.write_cmd -> command, counted from the oldest entry
 				// cmd_arg.write_cmd_offset -> offset
 
-				if (cmd_arg.write_cmd < 0 
-					|| cmd_arg.write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
-					|| dev->buffer.entry[cmd_arg.write_cmd].buffptr == NULL
-					|| dev->buffer.entry[cmd_arg.write_cmd].size <= cmd_arg.write_cmd_offset) {
+				if (!aesd_circular_buffer_find_fpos_for_entry(&dev->buffer,
+						cmd_arg.write_cmd, cmd_arg.write_cmd_offset, &pos)) {
 					result = -EINVAL;
 				} else {
-					pos = 0;
-
-					for (i = 0; i < cmd_arg.write_cmd; i++) {
-						pos += dev->buffer.entry[i].size;
-					}
-
-					// set f_pos
-					filp->f_pos = pos + cmd_arg.write_cmd_offset;
+					// set f_pos (O(1) from the entry's running offset)
+					filp->f_pos = pos;
+					af->tail_offs = dev->buffer.base + pos;
 					PDEBUG("IOCTL >> cmd=%d, offset=%d, pos=%lld", 
 						cmd_arg.write_cmd, cmd_arg.write_cmd_offset, filp->f_pos);
 
@@ -247,6 +1238,33 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 				}
 			}
 			break;
+		case AESDCHAR_IOCSETTAIL:
+			if (get_user(tail, (uint32_t __user *) arg)) {
+				result = -EFAULT;
+			} else {
+				// follow the history from the current file position on
+				if (tail && !af->tail) af->tail_offs = dev->buffer.base + filp->f_pos;
+				if (!tail && af->tail) filp->f_pos = aesd_tail_fpos(dev, af);
+				af->tail = (tail != 0);
+				result = 0;
+			}
+			break;
+		case AESDCHAR_IOCGETSTATS:
+			spin_lock(&dev->pool_lock);
+			stats = dev->stats;
+			stats.pool_chunks = dev->pool_count;
+			spin_unlock(&dev->pool_lock);
+
+			stats.entries = aesd_circular_buffer_count(&dev->buffer);
+			stats.bytes = dev->buffer.size;
+			stats.capacity = dev->buffer.capacity;
+			stats.max_bytes = dev->buffer.max_bytes;
+			stats.ring_size = dev->buffer.ring_size;
+			stats.read_retries = atomic_long_read(&dev->read_retries);
+			stats.locked_reads = atomic_long_read(&dev->locked_reads);
+
+			result = copy_to_user((void __user *) arg, &stats, sizeof(stats)) ? -EFAULT : 0;
+			break;
 		default:
 			result = -EINVAL;
 	}
@@ -256,19 +1274,142 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	return result;
 }
 
+long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct aesd_dev *dev = ((struct aesd_file *) filp->private_data)->dev;
+	u64 start = ktime_get_ns();
+	long result;
+
+	result = aesd_ioctl_cmd(filp, cmd, arg);
+
+	trace_aesd_ioctl(AESD_MINOR(dev), cmd, result, ktime_get_ns() - start);
+
+	return result;
+}
+
+static void aesd_vma_open(struct vm_area_struct *vma)
+{
+	struct aesd_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->mmap_count);
+}
+
+static void aesd_vma_close(struct vm_area_struct *vma)
+{
+	struct aesd_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->mmap_count);
+}
+
+static const struct vm_operations_struct aesd_vm_ops = {
+	.open  = aesd_vma_open,
+	.close = aesd_vma_close,
+};
+
+/**
+ * Maps the header, entry table and ring read-only (struct aesd_mmap_header)
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct aesd_dev *dev = ((struct aesd_file *) filp->private_data)->dev;
+	void *area;
+	int rc;
+
+	if (vma->vm_flags & VM_WRITE) return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	// the area stays while it is counted as mapped
+	spin_lock(&dev->area_lock);
+	if (dev->area_frozen) {
+		spin_unlock(&dev->area_lock);
+		return -EBUSY;
+	}
+	area = dev->area;
+	atomic_inc(&dev->mmap_count);
+	spin_unlock(&dev->area_lock);
+
+	rc = remap_vmalloc_range(vma, area, vma->vm_pgoff);
+	if (rc) {
+		atomic_dec(&dev->mmap_count);
+		return rc;
+	}
+
+	vma->vm_private_data = dev;
+	vma->vm_ops = &aesd_vm_ops;
+
+	return 0;
+}
+
 struct file_operations aesd_fops = {
     .owner  = THIS_MODULE,
-    .read   = aesd_read,
-    .write  = aesd_write,
+    .read_iter = aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#else
+	.splice_read = generic_file_splice_read,
+#endif
+    .write_iter = aesd_write_iter,
     .open   = aesd_open,
 	.llseek = aesd_seek,
+	.poll   = aesd_poll,
+	.mmap   = aesd_mmap,
 	.unlocked_ioctl  = aesd_ioctl,
     .release= aesd_release,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static void aesd_debugfs_latency(struct seq_file *m, const char *name, atomic_long_t *buckets)
+{
+	unsigned int i;
+
+	seq_printf(m, "%-18s", name);
+	for (i = 0; i < AESD_LAT_BUCKETS; i++) {
+		seq_printf(m, " %ld", atomic_long_read(&buckets[i]));
+	}
+	seq_putc(m, '\n');
+}
+
+/**
+ * debugfs aesdchar/aesdchar<N>: counters and gauges of the device, latency
+ * buckets from < 1 us to >= 2^14 us (doubling)
+ */
+static int aesd_debugfs_show(struct seq_file *m, void *v)
+{
+	struct aesd_dev *dev = m->private;
+	struct aesd_counters *c = &dev->counters;
+
+	if (aesd_lock_interruptible(dev)) return -ERESTARTSYS;
+
+	seq_printf(m, "bytes_written      %ld\n", atomic_long_read(&c->bytes_written));
+	seq_printf(m, "bytes_read         %ld\n", atomic_long_read(&c->bytes_read));
+	seq_printf(m, "entries_committed  %ld\n", atomic_long_read(&c->entries_committed));
+	seq_printf(m, "entries_evicted    %llu\n", (unsigned long long) dev->stats.evicted_entries);
+	seq_printf(m, "bytes_evicted      %llu\n", (unsigned long long) dev->stats.evicted_bytes);
+	seq_printf(m, "entries            %u / %u\n", aesd_circular_buffer_count(&dev->buffer),
+		dev->buffer.capacity);
+	seq_printf(m, "ring_bytes         %zu / %zu\n", dev->buffer.size, dev->buffer.ring_size);
+	seq_printf(m, "partial_writes     %ld\n", atomic_long_read(&c->partial_writes));
+	seq_printf(m, "lock_contended     %ld\n", atomic_long_read(&c->lock_contended));
+	seq_printf(m, "read_retries       %ld\n", atomic_long_read(&dev->read_retries));
+	seq_printf(m, "locked_reads       %ld\n", atomic_long_read(&dev->locked_reads));
+
+	mutex_unlock(&dev->lock);
+
+	aesd_debugfs_latency(m, "read_latency_us", c->read_lat);
+	aesd_debugfs_latency(m, "write_latency_us", c->write_lat);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(aesd_debugfs);
+
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
 
@@ -277,76 +1418,173 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
 
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %u", err, index);
     }
     return err;
 }
 
+/**
+ * Initializes one device: locks, empty history and its mmap area
+ */
+static int aesd_dev_init(struct aesd_dev *dev)
+{
+	void *area;
+	int result;
+
+	// intialize data
+	mutex_init(&dev->lock);   // mutex init
+	seqcount_mutex_init(&dev->seq, &dev->lock);
+	init_rwsem(&dev->resize_sem);
+	init_waitqueue_head(&dev->wait);
+	spin_lock_init(&dev->area_lock);
+	spin_lock_init(&dev->pool_lock);
+	aesd_circular_buffer_init(&dev->buffer); // circular buffer (set zeroes)
+	dev->working.head = NULL;                // working buffer (no chunk yet)
+	dev->working.tail = NULL;
+	dev->working.size = 0;
+
+	dev->buffer.max_bytes = ring_bytes;
+
+	// byte ring holding the entries, behind the mmap header and entry table
+	area = aesd_area_alloc(dev->buffer.capacity, ring_size);
+	if (area == NULL) return -ENOMEM;
+
+	aesd_area_install(dev, area);
+
+	// entry array sized by the module parameter
+	if (ring_entries != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+		result = aesd_set_capacity(dev, ring_entries);
+		if (result) {
+			printk(KERN_WARNING "aesdchar: invalid ring_entries %u\n", ring_entries);
+			vfree(dev->area);
+			dev->area = NULL;
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Frees the history, the working buffer and the chunk pool of one device
+ */
+static void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+	// free working buffer
+	aesd_chunks_free(dev->working.head);
+	dev->working.head = dev->working.tail = NULL;
+	dev->working.size = 0;
+
+	// free circular buffer (the entries are in the ring)
+	vfree(dev->area);
+	dev->area = NULL;
+	dev->buffer.ring = NULL;
+
+	aesd_chunks_free(dev->pool);
+	dev->pool = NULL;
+	dev->pool_count = 0;
+
+	if (dev->buffer.entry != dev->buffer.inline_entry) {
+		kvfree(dev->buffer.entry);
+	}
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
+	unsigned int i, n_init = 0, n_added = 0;
+	char name[24];
 
 	printk(KERN_ALERT "Hello, this aesd char driver");
 
+	if (nr_devices == 0 || nr_devices > AESD_MAX_DEVICES) {
+		printk(KERN_WARNING "aesdchar: invalid nr_devices %u\n", nr_devices);
+		return -EINVAL;
+	}
+
+	if (ring_size == 0 || ring_size > SIZE_MAX) {
+		printk(KERN_WARNING "aesdchar: invalid ring_size %lu\n", ring_size);
+		return -EINVAL;
+	}
+
+	aesd_chunk_cache = kmem_cache_create("aesd_chunk", AESD_CHUNK_SIZE, 0, 0, NULL);
+	if (aesd_chunk_cache == NULL) return -ENOMEM;
+
 	// dynamic allocation of device number
-    result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
+    result = alloc_chrdev_region(&dev, aesd_minor, nr_devices, "aesdchar");
     aesd_major = MAJOR(dev);
 
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
+        kmem_cache_destroy(aesd_chunk_cache);
         return result;
     }
 
 	// initialize data
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
+	aesd_devices = kcalloc(nr_devices, sizeof(struct aesd_dev), GFP_KERNEL);
+	if (aesd_devices == NULL) {
+		result = -ENOMEM;
+		goto fail_region;
+	}
 
     /* TODO: initialize the AESD specific portion of the device */
 
-	// intialize data
-	mutex_init(&aesd_device.lock);   // mutex init
-	aesd_circular_buffer_init(&aesd_device.buffer); // circular buffer (set zeroes)
-	aesd_device.working.size = 0;                   // working buffer
+	for (n_init = 0; n_init < nr_devices; n_init++) {
+		result = aesd_dev_init(&aesd_devices[n_init]);
+		if (result) goto fail_devices;
+	}
 
 	/* TODO-END */
 
-	// device setup
-    result = aesd_setup_cdev(&aesd_device);
+	// device setup, the devices are reachable from here on
+	for (n_added = 0; n_added < nr_devices; n_added++) {
+		result = aesd_setup_cdev(&aesd_devices[n_added], n_added);
+		if (result) goto fail_devices;
+	}
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
-    }
-    return result;
+	// counters, the driver works without them (debugfs errors are ignored)
+	aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+	for (i = 0; i < nr_devices; i++) {
+		snprintf(name, sizeof(name), "aesdchar%u", i);
+		debugfs_create_file(name, 0444, aesd_debugfs_root, &aesd_devices[i], &aesd_debugfs_fops);
+	}
+
+    return 0;
+
+fail_devices:
+	for (i = 0; i < n_added; i++) cdev_del(&aesd_devices[i].cdev);
+	for (i = 0; i < n_init; i++) aesd_dev_cleanup(&aesd_devices[i]);
+	kfree(aesd_devices);
+	aesd_devices = NULL;
+fail_region:
+	unregister_chrdev_region(dev, nr_devices);
+	kmem_cache_destroy(aesd_chunk_cache);
+	return result;
 }
 
 void aesd_cleanup_module(void)
 {
-	int i;
-
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+	unsigned int i;
+
+	debugfs_remove_recursive(aesd_debugfs_root);
 
-    cdev_del(&aesd_device.cdev);
+	for (i = 0; i < nr_devices; i++) cdev_del(&aesd_devices[i].cdev);
 
     /* TODO: cleanup AESD specific poritions here as necessary */
 
-	// free working buffer
-	if (aesd_device.working.size > 0) {
-		kfree(aesd_device.working.buffptr);
-		aesd_device.working.size = 0;
-	}
+	for (i = 0; i < nr_devices; i++) aesd_dev_cleanup(&aesd_devices[i]);
 
-	// free circular buffer
-	for(i=0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-		if (aesd_device.buffer.entry[i].size > 0) {
-			kfree(aesd_device.buffer.entry[i].buffptr);
-			aesd_device.buffer.entry[i].size = 0;
-		}
-	}
+	kfree(aesd_devices);
+	aesd_devices = NULL;
 
 	/* TODO-END */
 
 	// unregister device
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, nr_devices);
+
+	kmem_cache_destroy(aesd_chunk_cache);
 }
 
 
@@ -0,0 +1,527 @@
+/*
+** aesd-core-bench.c -- microbenchmarks of the aesdchar data path, in userspace
+*
+*   usage: aesd-core-bench [name]
+*
+*   Runs the driver code which does not depend on the kernel (aesd-core.c and
+*   aesd-circular-buffer.c) without loading the module:
+*
+*     add_entry  make room, copy and add one entry, by entry size
+*     find       aesd_circular_buffer_find_entry_offset_for_fpos, by entry count
+*     read       one pass over the whole history by READ_SIZE calls, by entry count
+*     entries    the table of AESDCHAR_IOCGETENTRIES for the whole history, by
+*                entry count
+*     partial    128 byte commands written in pieces, staged and committed
+*                by the functions of write_iter, by piece size
+*     mix        threads writing commands and reading the history, by thread
+*                count and share of writes: writers take a mutex and bump a
+*                sequence around their changes, readers copy without a lock
+*                and retry when it moved, as with dev->seq in the driver (the
+*                seqcount is a kernel primitive, it is the only part which
+*                is not the driver code)
+*
+*   With a name, runs that benchmark only. Every result is one line
+*   "benchmark param ns/op ops/s", so that runs of two builds can be diffed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "../aesd-core.h"
+
+#define OPS (1 << 20)
+#define RECORD 128           // command size of partial and mix
+#define READ_SIZE 4096       // bytes read per history read of mix
+#define MAX_THREADS 16
+#define READ_RETRIES 4       // AESD_READ_RETRIES of the driver
+
+struct bench_ring
+{
+	struct aesd_circular_buffer buffer;
+	struct aesd_buffer_entry *entries;
+	char *ring;
+};
+
+// free chunks, as the pool of the driver
+static struct aesd_chunk *pool;
+
+static unsigned long long volatile sink;
+
+static double now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned int next_rand(unsigned int *state)
+{
+	*state = *state * 1103515245 + 12345;
+
+	return *state >> 8;
+}
+
+static void report(const char *name, const char *param, double ns, unsigned long ops)
+{
+	printf("%-10s %-20s %10.1f %14.0f\n", name, param, ns / ops, ops * 1e9 / ns);
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (p == NULL) {
+		perror("calloc");
+		exit(-1);
+	}
+
+	return p;
+}
+
+static void ring_init(struct bench_ring *br, uint32_t capacity, size_t ring_size)
+{
+	aesd_circular_buffer_init(&br->buffer);
+
+	br->entries = xmalloc(capacity * sizeof(struct aesd_buffer_entry));
+	aesd_circular_buffer_resize(&br->buffer, br->entries, capacity);
+
+	br->ring = xmalloc(ring_size);
+	br->buffer.ring = br->ring;
+	br->buffer.ring_size = ring_size;
+}
+
+static void ring_free(struct bench_ring *br)
+{
+	free(br->entries);
+	free(br->ring);
+}
+
+// the commit of the driver for a contiguous command
+static void ring_add(struct bench_ring *br, const char *data, size_t size)
+{
+	struct aesd_buffer_entry entry;
+
+	entry.buffptr = aesd_core_make_room(&br->buffer, size, NULL, NULL);
+	entry.size = size;
+	memcpy((char *) entry.buffptr, data, size);
+
+	aesd_circular_buffer_add_entry(&br->buffer, &entry);
+}
+
+// copy callback of aesd_core_copy_history, ctx points to the destination
+static size_t copy_mem(void *ctx, const char *src, size_t len)
+{
+	char **dst = ctx;
+
+	memcpy(*dst, src, len);
+	*dst += len;
+
+	return len;
+}
+
+// copies up to size history bytes from pos as aesd_copy_history does, -EAGAIN
+// for a location outside the ring, which a lockless reader may see
+static ssize_t ring_read(struct bench_ring *br, size_t pos, char *buf, size_t size)
+{
+	return aesd_core_copy_history(&br->buffer, pos, size, copy_mem, &buf);
+}
+
+static struct aesd_chunk *chunk_get(void *ctx)
+{
+	struct aesd_chunk *chunk = pool;
+
+	if (chunk != NULL) {
+		pool = chunk->next;
+	} else {
+		chunk = xmalloc(AESD_CHUNK_SIZE);
+	}
+
+	chunk->next = NULL;
+	chunk->used = 0;
+
+	return chunk;
+}
+
+static void chunks_put(void *ctx, struct aesd_chunk *chunk)
+{
+	struct aesd_chunk *next;
+
+	for (; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		chunk->next = pool;
+		pool = chunk;
+	}
+}
+
+// staging and commit from the pool, evictions by aesd_circular_buffer_remove_entry
+static const struct aesd_core_ops bench_ops = {
+	.alloc = chunk_get,
+	.release = chunks_put,
+};
+
+static void bench_add_entry(size_t size)
+{
+	struct bench_ring br;
+	char *data = xmalloc(size), param[32];
+	double t0;
+	long i;
+
+	memset(data, 'a', size);
+	ring_init(&br, 1024, 1024 * 1024);
+
+	t0 = now_ns();
+	for (i = 0; i < OPS; i++) {
+		ring_add(&br, data, size);
+	}
+
+	snprintf(param, sizeof(param), "size=%zu", size);
+	report("add_entry", param, now_ns() - t0, OPS);
+
+	ring_free(&br);
+	free(data);
+}
+
+static void bench_find(uint32_t capacity)
+{
+	struct bench_ring br;
+	struct aesd_buffer_entry *entry;
+	char data[64], param[32];
+	size_t *pos = xmalloc(OPS * sizeof(size_t)), offs;
+	unsigned int state = 1;
+	double t0;
+	long i;
+
+	memset(data, 'f', sizeof(data));
+	ring_init(&br, capacity, (size_t) capacity * sizeof(data));
+
+	// a full buffer, wrapped once so that out_offs is not 0
+	for (i = 0; i < capacity + capacity / 2; i++) {
+		ring_add(&br, data, sizeof(data));
+	}
+
+	for (i = 0; i < OPS; i++) {
+		pos[i] = next_rand(&state) % br.buffer.size;
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < OPS; i++) {
+		entry = aesd_circular_buffer_find_entry_offset_for_fpos(&br.buffer, pos[i], &offs);
+		sink += entry->size + offs;
+	}
+
+	snprintf(param, sizeof(param), "entries=%u", capacity);
+	report("find", param, now_ns() - t0, OPS);
+
+	ring_free(&br);
+	free(pos);
+}
+
+static void bench_read(uint32_t capacity)
+{
+	struct bench_ring br;
+	char data[64], param[32], buf[READ_SIZE];
+	size_t pos;
+	ssize_t n;
+	long i, rounds = OPS / capacity;
+	double t0;
+
+	memset(data, 'r', sizeof(data));
+	ring_init(&br, capacity, (size_t) capacity * sizeof(data));
+
+	for (i = 0; i < capacity + capacity / 2; i++) {
+		ring_add(&br, data, sizeof(data));
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < rounds; i++) {
+		for (pos = 0; (n = ring_read(&br, pos, buf, sizeof(buf))) > 0; pos += n) {
+			sink += buf[n - 1];
+		}
+	}
+
+	snprintf(param, sizeof(param), "entries=%u", capacity);
+	report("read", param, now_ns() - t0, rounds);
+
+	ring_free(&br);
+}
+
+static void bench_entries(uint32_t capacity)
+{
+	struct bench_ring br;
+	struct aesd_entry_info *info = xmalloc(capacity * sizeof(struct aesd_entry_info));
+	char data[64], param[32];
+	long i, rounds = OPS / capacity;
+	double t0;
+
+	memset(data, 'e', sizeof(data));
+	ring_init(&br, capacity, (size_t) capacity * sizeof(data));
+
+	for (i = 0; i < capacity + capacity / 2; i++) {
+		ring_add(&br, data, sizeof(data));
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < rounds; i++) {
+		sink += aesd_core_entries(&br.buffer, i, info, capacity);
+		sink += info[capacity - 1].pos;
+	}
+
+	snprintf(param, sizeof(param), "entries=%u", capacity);
+	report("entries", param, now_ns() - t0, rounds);
+
+	ring_free(&br);
+	free(info);
+}
+
+// stages the n bytes of one write call as write_iter does, the complete
+// commands join the batch
+static void stage(struct bench_ring *br, struct aesd_working *working,
+	struct aesd_working *batch, const char *src, size_t n)
+{
+	size_t room, len, used;
+	char *dst;
+
+	while (n > 0) {
+		dst = aesd_core_stage_buffer(working, &room, &bench_ops, NULL);
+
+		len = (n < room) ? n : room;
+		memcpy(dst, src, len);
+
+		aesd_core_stage(working, batch, len, &used, br->buffer.ring_size, &bench_ops, NULL);
+		src += used;
+		n -= used;
+	}
+}
+
+// commits the staged commands as aesd_commit_batch does
+static void commit(struct bench_ring *br, struct aesd_working *batch)
+{
+	struct aesd_chunk *head;
+	size_t size;
+
+	while ((head = aesd_core_next_command(batch, &size)) != NULL) {
+		aesd_core_commit(&br->buffer, NULL, head, size, &bench_ops, NULL);
+	}
+}
+
+static void bench_partial(size_t piece)
+{
+	struct bench_ring br;
+	struct aesd_working working = { NULL, NULL, 0 }, batch = { NULL, NULL, 0 };
+	char record[RECORD], param[32];
+	size_t off;
+	double t0;
+	long i;
+
+	memset(record, 'p', sizeof(record) - 1);
+	record[sizeof(record) - 1] = '\n';
+	ring_init(&br, 1024, 1024 * 1024);
+
+	t0 = now_ns();
+	for (i = 0; i < OPS / 4; i++) {
+		for (off = 0; off < sizeof(record); off += piece) {
+			stage(&br, &working, &batch, record + off,
+				(sizeof(record) - off < piece) ? sizeof(record) - off : piece);
+		}
+		commit(&br, &batch);
+	}
+
+	snprintf(param, sizeof(param), "piece=%zu", piece);
+	report("partial", param, now_ns() - t0, OPS / 4);
+
+	ring_free(&br);
+}
+
+// the seqcount of the driver (write_seqcount_begin/end, read_seqcount_begin/retry)
+static void seq_write_begin(atomic_uint *seq)
+{
+	atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1,
+		memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void seq_write_end(atomic_uint *seq)
+{
+	atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1,
+		memory_order_release);
+}
+
+static unsigned int seq_read_begin(atomic_uint *seq)
+{
+	unsigned int start;
+
+	// odd while a writer is inside
+	while ((start = atomic_load_explicit(seq, memory_order_acquire)) & 1) {
+	}
+
+	return start;
+}
+
+static bool seq_read_retry(atomic_uint *seq, unsigned int start)
+{
+	atomic_thread_fence(memory_order_acquire);
+
+	return atomic_load_explicit(seq, memory_order_relaxed) != start;
+}
+
+struct mix_arg
+{
+	struct bench_ring *br;
+	pthread_mutex_t *lock;
+	atomic_uint *seq;
+	unsigned int write_pct;
+	unsigned int seed;
+	long ops;
+};
+
+// reads READ_SIZE bytes from a random position, as aesd_read_history does:
+// without the lock, redone when a write overlapped it, under the lock when
+// the writers keep changing the ring
+static ssize_t mix_read(struct mix_arg *ma, unsigned int *state, char *buf)
+{
+	struct bench_ring *br = ma->br;
+	unsigned int start, tries;
+	ssize_t n;
+	size_t size;
+
+	for (tries = 0; tries < READ_RETRIES; tries++) {
+		start = seq_read_begin(ma->seq);
+
+		size = br->buffer.size;
+		n = (size > 0) ? ring_read(br, next_rand(state) % size, buf, READ_SIZE) : 0;
+
+		if (!seq_read_retry(ma->seq, start)) return n;
+	}
+
+	pthread_mutex_lock(ma->lock);
+	size = br->buffer.size;
+	n = (size > 0) ? ring_read(br, next_rand(state) % size, buf, READ_SIZE) : 0;
+	pthread_mutex_unlock(ma->lock);
+
+	return n;
+}
+
+static void *mix_thread(void *arg)
+{
+	struct mix_arg *ma = arg;
+	char record[RECORD], buf[READ_SIZE];
+	unsigned int state = ma->seed;
+	size_t n = 0;
+	ssize_t rc;
+	long i;
+
+	memset(record, 'm', sizeof(record) - 1);
+	record[sizeof(record) - 1] = '\n';
+
+	for (i = 0; i < ma->ops; i++) {
+		if (next_rand(&state) % 100 < ma->write_pct) {
+			pthread_mutex_lock(ma->lock);
+			seq_write_begin(ma->seq);
+			ring_add(ma->br, record, sizeof(record));
+			seq_write_end(ma->seq);
+			pthread_mutex_unlock(ma->lock);
+		} else {
+			rc = mix_read(ma, &state, buf);
+			if (rc > 0) n += rc;
+		}
+	}
+
+	sink += n;
+
+	return NULL;
+}
+
+static void bench_mix(int threads, unsigned int write_pct)
+{
+	struct bench_ring br;
+	pthread_mutex_t lock;
+	atomic_uint seq = 0;
+	pthread_t tid[MAX_THREADS];
+	struct mix_arg arg[MAX_THREADS];
+	char record[RECORD], param[32];
+	double t0;
+	int i;
+
+	memset(record, 'm', sizeof(record));
+	ring_init(&br, 1024, 1024 * 1024);
+	pthread_mutex_init(&lock, NULL);
+
+	for (i = 0; i < 1024; i++) {
+		ring_add(&br, record, sizeof(record));
+	}
+
+	t0 = now_ns();
+	for (i = 0; i < threads; i++) {
+		arg[i].br = &br;
+		arg[i].lock = &lock;
+		arg[i].seq = &seq;
+		arg[i].write_pct = write_pct;
+		arg[i].seed = i + 1;
+		arg[i].ops = OPS / 4 / threads;
+		pthread_create(&tid[i], NULL, mix_thread, &arg[i]);
+	}
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(tid[i], NULL);
+	}
+
+	snprintf(param, sizeof(param), "threads=%d,writes=%u%%", threads, write_pct);
+	report("mix", param, now_ns() - t0, (OPS / 4 / threads) * threads);
+
+	pthread_mutex_destroy(&lock);
+	ring_free(&br);
+}
+
+static bool selected(int argc, char *argv[], const char *name)
+{
+	return argc < 2 || strcmp(argv[1], name) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t sizes[] = { 16, 256, 4096 };
+	static const uint32_t capacities[] = { 10, 100, 1000, 10000 };
+	static const size_t pieces[] = { 1, 16, 64, 128 };
+	static const int threads[] = { 1, 2, 4, 8 };
+	static const unsigned int write_pcts[] = { 10, 50 };
+	unsigned int i, j;
+
+	printf("%-10s %-20s %10s %14s\n", "benchmark", "param", "ns/op", "ops/s");
+
+	if (selected(argc, argv, "add_entry")) {
+		for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) bench_add_entry(sizes[i]);
+	}
+
+	if (selected(argc, argv, "find")) {
+		for (i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++) bench_find(capacities[i]);
+	}
+
+	if (selected(argc, argv, "read")) {
+		for (i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++) bench_read(capacities[i]);
+	}
+
+	if (selected(argc, argv, "entries")) {
+		for (i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++) bench_entries(capacities[i]);
+	}
+
+	if (selected(argc, argv, "partial")) {
+		for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) bench_partial(pieces[i]);
+	}
+
+	if (selected(argc, argv, "mix")) {
+		for (j = 0; j < sizeof(write_pcts) / sizeof(write_pcts[0]); j++) {
+			for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+				bench_mix(threads[i], write_pcts[j]);
+			}
+		}
+	}
+
+	return 0;
+}
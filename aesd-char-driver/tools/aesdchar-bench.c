@@ -0,0 +1,698 @@
+/*
+** aesdchar-bench.c -- microbenchmarks of the aesdchar driver
+*
+*   usage: aesdchar-bench [-d device] [-n records] [-s size] [-t threads] [-w] mode
+*
+*   modes:
+*     write1   each record is delivered one byte per write() call, the
+*              driver accumulates the partial writes until the newline
+*     write    each record is delivered by a single write() call
+*     writev   records are delivered IOV_BATCH at a time by writev(), one
+*              iovec per record, the driver commits them under one lock
+*     read     reads the whole history records times (like cat), size
+*              bytes per read() call; fill the device with a write mode first
+*     readers  read mode in 1, 2, 4 .. threads concurrently, each thread
+*              doing records passes; with -w a writer appends size byte
+*              records meanwhile. Shows how the readers scale.
+*     mmap     like read, through the read-only mapping of the device: each
+*              pass copies a consistent snapshot of the history with no
+*              system call (struct aesd_mmap_header retry protocol)
+*     writers  1, 2, 4 .. threads writers on the device, each with its own
+*              file, each record delivered in two write() calls: the halves
+*              are staged per file, only the commit takes the device lock
+*     shards   threads writers appending records each, all to the device,
+*              then each to its own device (device0 .. device<threads-1>,
+*              load the module with nr_devices=threads). Shows how
+*              independent producers scale across devices.
+*     send     replays the history records times to a socket like the
+*              server does without sendfile: read() into a size byte buffer,
+*              then send(); a thread drains the other end of the socket pair
+*     sendfile same replay with sendfile(), the bytes go from the driver to
+*              the socket through splice_read and never reach userspace
+*     entries  fetches the entry table (AESDCHAR_IOCGETENTRIES) records
+*              times, against finding the boundaries by reading the whole
+*              history and looking for the newlines (size bytes per read)
+*     stats    prints the device counters (AESDCHAR_IOCGETSTATS), run it
+*              after a write mode to see the chunk allocations it caused
+*
+*   Records are size bytes long, newline included. Reported times are per
+*   record and per write() call.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "../aesd_ioctl.h"
+
+#define DEFAULT_DEVICE "/dev/aesdchar"
+#define IOV_BATCH 16
+
+struct bench_opts {
+	const char *device;
+	long records;
+	size_t size;
+	int threads;
+	int writer;
+};
+
+static double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_device(const char *device, int flags)
+{
+	int fd = open(device, flags);
+
+	if (fd < 0) {
+		perror(device);
+		exit(-1);
+	}
+
+	return fd;
+}
+
+static void fill_record(char *rec, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < size; i++) rec[i] = 'a' + i % 26;
+	rec[size - 1] = '\n';
+}
+
+static void report(const char *mode, const struct bench_opts *o, long calls, double t)
+{
+	printf("%-8s %ld records of %zu bytes: %.0f records/s, %.0f ns/record, %.0f ns/write, %.1f MB/s\n",
+		mode, o->records, o->size, o->records / t, t * 1e9 / o->records,
+		t * 1e9 / calls, o->records * o->size / t / 1e6);
+}
+
+static int bench_write1(const struct bench_opts *o)
+{
+	char *rec = malloc(o->size);
+	int fd = open_device(o->device, O_WRONLY);
+	long r, calls = 0;
+	size_t i;
+	double t0;
+
+	fill_record(rec, o->size);
+
+	t0 = now_sec();
+	for (r = 0; r < o->records; r++) {
+		for (i = 0; i < o->size; i++, calls++) {
+			if (write(fd, rec + i, 1) != 1) {
+				perror("write");
+				return -1;
+			}
+		}
+	}
+	report("write1", o, calls, now_sec() - t0);
+
+	close(fd);
+	free(rec);
+
+	return 0;
+}
+
+static int bench_write(const struct bench_opts *o)
+{
+	char *rec = malloc(o->size);
+	int fd = open_device(o->device, O_WRONLY);
+	long r;
+	double t0;
+
+	fill_record(rec, o->size);
+
+	t0 = now_sec();
+	for (r = 0; r < o->records; r++) {
+		if (write(fd, rec, o->size) != (ssize_t) o->size) {
+			perror("write");
+			return -1;
+		}
+	}
+	report("write", o, o->records, now_sec() - t0);
+
+	close(fd);
+	free(rec);
+
+	return 0;
+}
+
+static int bench_writev(const struct bench_opts *o)
+{
+	char *rec = malloc(o->size);
+	int fd = open_device(o->device, O_WRONLY);
+	struct iovec iov[IOV_BATCH];
+	long r, calls = 0;
+	int i, n;
+	double t0;
+
+	fill_record(rec, o->size);
+
+	for (i = 0; i < IOV_BATCH; i++) {
+		iov[i].iov_base = rec;
+		iov[i].iov_len = o->size;
+	}
+
+	t0 = now_sec();
+	for (r = 0; r < o->records; r += n, calls++) {
+		n = (o->records - r < IOV_BATCH) ? o->records - r : IOV_BATCH;
+		if (writev(fd, iov, n) != (ssize_t) (n * o->size)) {
+			perror("writev");
+			return -1;
+		}
+	}
+	report("writev", o, calls, now_sec() - t0);
+
+	close(fd);
+	free(rec);
+
+	return 0;
+}
+
+static int bench_read(const struct bench_opts *o)
+{
+	char *buf = malloc(o->size);
+	int fd = open_device(o->device, O_RDONLY);
+	long r, calls = 0;
+	size_t total = 0;
+	ssize_t n;
+	double t0, t;
+
+	t0 = now_sec();
+	for (r = 0; r < o->records; r++) {
+		lseek(fd, 0, SEEK_SET);
+		while ((n = read(fd, buf, o->size)) > 0) {
+			total += n;
+			calls++;
+		}
+		if (n < 0) {
+			perror("read");
+			return -1;
+		}
+	}
+	t = now_sec() - t0;
+
+	printf("read     %ld passes, %zu bytes in %ld read() calls: %.0f ns/read, %.1f MB/s\n",
+		o->records, total, calls, calls ? t * 1e9 / calls : 0, total / t / 1e6);
+
+	close(fd);
+	free(buf);
+
+	return 0;
+}
+
+/**
+ * Copies the history of a mapped device to out (cap bytes), retrying while the
+ * driver changes it. Returns the number of bytes copied.
+ */
+static size_t mmap_snapshot(const char *map, char *out, size_t cap, long *retries)
+{
+	const struct aesd_mmap_header *h = (const struct aesd_mmap_header *) map;
+	const struct aesd_mmap_entry *table, *e;
+	uint32_t seq, i, n, capacity, out_offs;
+	size_t len;
+
+	for (;; (*retries)++) {
+		seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) continue;
+
+		table = (const struct aesd_mmap_entry *) (map + h->table_offset);
+		capacity = h->capacity;
+		out_offs = h->out_offs;
+		n = h->full ? capacity : (h->in_offs + capacity - out_offs) % capacity;
+
+		// the entries are contiguous in the ring, a torn table is caught below
+		for (i = 0, len = 0; i < n; i++, len += e->size) {
+			e = &table[(out_offs + i) % capacity];
+			if (e->ring_pos + e->size > h->ring_size || len + e->size > cap) break;
+			memcpy(out + len, map + h->ring_offset + e->ring_pos, e->size);
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (i == n && __atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq) return len;
+	}
+}
+
+static int bench_mmap(const struct bench_opts *o)
+{
+	int fd = open_device(o->device, O_RDONLY);
+	const struct aesd_mmap_header *h;
+	size_t map_size, cap, total = 0;
+	long r, retries = 0;
+	char *map, *buf;
+	double t0, t;
+
+	// the header tells the size of the whole mapping
+	h = mmap(NULL, sizeof(*h), PROT_READ, MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	map_size = h->ring_offset + h->ring_size;
+	cap = h->ring_size;
+	munmap((void *) h, sizeof(*h));
+
+	map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	buf = malloc(cap);
+	if (map == MAP_FAILED || buf == NULL) {
+		perror("mmap");
+		return -1;
+	}
+
+	t0 = now_sec();
+	for (r = 0; r < o->records; r++) {
+		total += mmap_snapshot(map, buf, cap, &retries);
+	}
+	t = now_sec() - t0;
+
+	printf("mmap     %ld passes, %zu bytes: %.0f ns/pass, %.1f MB/s, %ld retries\n",
+		o->records, total, t * 1e9 / o->records, total / t / 1e6, retries);
+
+	munmap(map, map_size);
+	close(fd);
+	free(buf);
+
+	return 0;
+}
+
+struct reader_arg {
+	const struct bench_opts *o;
+	size_t total;
+};
+
+static volatile int readers_done;
+
+static void *reader_thread(void *arg)
+{
+	struct reader_arg *ra = arg;
+	char *buf = malloc(ra->o->size);
+	int fd = open_device(ra->o->device, O_RDONLY);
+	ssize_t n;
+	long r;
+
+	for (r = 0; r < ra->o->records; r++) {
+		lseek(fd, 0, SEEK_SET);
+		while ((n = read(fd, buf, ra->o->size)) > 0) ra->total += n;
+	}
+
+	close(fd);
+	free(buf);
+
+	return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+	const struct bench_opts *o = arg;
+	char *rec = malloc(o->size);
+	int fd = open_device(o->device, O_WRONLY);
+	long *written = calloc(1, sizeof(long));
+
+	fill_record(rec, o->size);
+
+	while (!readers_done) {
+		if (write(fd, rec, o->size) != (ssize_t) o->size) break;
+		(*written)++;
+	}
+
+	close(fd);
+	free(rec);
+
+	return written;
+}
+
+static int bench_readers(const struct bench_opts *o)
+{
+	struct reader_arg *ra = calloc(o->threads, sizeof(struct reader_arg));
+	pthread_t *tid = calloc(o->threads, sizeof(pthread_t));
+	pthread_t wtid;
+	long *written = NULL;
+	size_t total;
+	double t0, t;
+	int n, i;
+
+	// 1, 2, 4 .. threads, the last round with exactly o->threads
+	for (n = 1; ; n = (n * 2 < o->threads) ? n * 2 : o->threads) {
+		readers_done = 0;
+		if (o->writer) pthread_create(&wtid, NULL, writer_thread, (void *) o);
+
+		t0 = now_sec();
+		for (i = 0; i < n; i++) {
+			ra[i].o = o;
+			ra[i].total = 0;
+			pthread_create(&tid[i], NULL, reader_thread, &ra[i]);
+		}
+
+		total = 0;
+		for (i = 0; i < n; i++) {
+			pthread_join(tid[i], NULL);
+			total += ra[i].total;
+		}
+		t = now_sec() - t0;
+
+		readers_done = 1;
+		if (o->writer) pthread_join(wtid, (void **) &written);
+
+		printf("readers  %2d threads: %.1f MB/s total, %.1f MB/s per thread", n,
+			total / t / 1e6, total / t / 1e6 / n);
+		if (written) printf(", writer %.0f records/s", *written / t);
+		printf("\n");
+
+		free(written);
+		written = NULL;
+
+		if (n == o->threads) break;
+	}
+
+	free(ra);
+	free(tid);
+
+	return 0;
+}
+
+struct shard_arg {
+	const struct bench_opts *o;
+	char device[256];
+	int split;
+};
+
+/**
+ * Writes records to its device, in two halves with split
+ */
+static void *shard_thread(void *arg)
+{
+	struct shard_arg *sa = arg;
+	char *rec = malloc(sa->o->size);
+	int fd = open_device(sa->device, O_WRONLY);
+	size_t half = sa->split ? sa->o->size / 2 : 0;
+	long r;
+
+	fill_record(rec, sa->o->size);
+
+	for (r = 0; r < sa->o->records; r++) {
+		if ((half > 0 && write(fd, rec, half) != (ssize_t) half)
+			|| write(fd, rec + half, sa->o->size - half) != (ssize_t) (sa->o->size - half)) {
+			perror("write");
+			break;
+		}
+	}
+
+	close(fd);
+	free(rec);
+
+	return NULL;
+}
+
+static int bench_shards(const struct bench_opts *o)
+{
+	struct shard_arg *sa = calloc(o->threads, sizeof(struct shard_arg));
+	pthread_t *tid = calloc(o->threads, sizeof(pthread_t));
+	double t0, t;
+	int sharded, i;
+
+	// all writers on one device, then one device per writer
+	for (sharded = 0; sharded <= 1; sharded++) {
+		for (i = 0; i < o->threads; i++) {
+			sa[i].o = o;
+			if (sharded) {
+				snprintf(sa[i].device, sizeof(sa[i].device), "%s%d", o->device, i);
+			} else {
+				snprintf(sa[i].device, sizeof(sa[i].device), "%s", o->device);
+			}
+		}
+
+		t0 = now_sec();
+		for (i = 0; i < o->threads; i++) pthread_create(&tid[i], NULL, shard_thread, &sa[i]);
+		for (i = 0; i < o->threads; i++) pthread_join(tid[i], NULL);
+		t = now_sec() - t0;
+
+		printf("shards   %2d writers on %2d device(s): %.0f records/s total, %.0f records/s per writer\n",
+			o->threads, sharded ? o->threads : 1, o->threads * o->records / t, o->records / t);
+	}
+
+	free(sa);
+	free(tid);
+
+	return 0;
+}
+
+static int bench_writers(const struct bench_opts *o)
+{
+	struct shard_arg *sa = calloc(o->threads, sizeof(struct shard_arg));
+	pthread_t *tid = calloc(o->threads, sizeof(pthread_t));
+	double t0, t;
+	int n, i;
+
+	// 1, 2, 4 .. threads, the last round with exactly o->threads
+	for (n = 1; ; n = (n * 2 < o->threads) ? n * 2 : o->threads) {
+		for (i = 0; i < n; i++) {
+			sa[i].o = o;
+			sa[i].split = 1;
+			snprintf(sa[i].device, sizeof(sa[i].device), "%s", o->device);
+		}
+
+		t0 = now_sec();
+		for (i = 0; i < n; i++) pthread_create(&tid[i], NULL, shard_thread, &sa[i]);
+		for (i = 0; i < n; i++) pthread_join(tid[i], NULL);
+		t = now_sec() - t0;
+
+		printf("writers  %2d threads: %.0f records/s total, %.0f records/s per writer\n",
+			n, n * o->records / t, o->records / t);
+
+		if (n == o->threads) break;
+	}
+
+	free(sa);
+	free(tid);
+
+	return 0;
+}
+
+static void *drain_thread(void *arg)
+{
+	int sock = *(int *) arg;
+	char buf[64 * 1024];
+
+	while (recv(sock, buf, sizeof(buf), 0) > 0);
+
+	return NULL;
+}
+
+/**
+ * Replays the history records times to a socket drained by another thread,
+ * through read() + send() or through sendfile().
+ */
+static int bench_replay(const struct bench_opts *o, const char *mode, int splice)
+{
+	char *buf = malloc(o->size);
+	int fd = open_device(o->device, O_RDONLY);
+	int sv[2];
+	pthread_t tid;
+	long r, calls = 0;
+	size_t total = 0;
+	off_t pos;
+	ssize_t n;
+	double t0, t;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+	pthread_create(&tid, NULL, drain_thread, &sv[1]);
+
+	t0 = now_sec();
+	for (r = 0; r < o->records; r++) {
+		pos = 0;
+		do {
+			if (splice) {
+				n = sendfile(sv[0], fd, &pos, 64 * 1024);
+			} else {
+				n = pread(fd, buf, o->size, pos);
+				if (n > 0 && send(sv[0], buf, n, 0) != n) n = -1;
+				if (n > 0) pos += n;
+			}
+			if (n > 0) {
+				total += n;
+				calls++;
+			}
+		} while (n > 0);
+		if (n < 0) {
+			perror(mode);
+			return -1;
+		}
+	}
+	t = now_sec() - t0;
+
+	shutdown(sv[0], SHUT_WR);
+	pthread_join(tid, NULL);
+
+	printf("%-8s %ld passes, %zu bytes in %ld calls: %.0f ns/call, %.1f MB/s\n",
+		mode, o->records, total, calls, calls ? t * 1e9 / calls : 0, total / t / 1e6);
+
+	close(sv[0]);
+	close(sv[1]);
+	close(fd);
+	free(buf);
+
+	return 0;
+}
+
+static int bench_send(const struct bench_opts *o)
+{
+	return bench_replay(o, "send", 0);
+}
+
+static int bench_sendfile(const struct bench_opts *o)
+{
+	return bench_replay(o, "sendfile", 1);
+}
+
+static int bench_entries(const struct bench_opts *o)
+{
+	int fd = open_device(o->device, O_RDONLY);
+	struct aesd_entry_info *info;
+	struct aesd_entries req;
+	struct aesd_stats st;
+	char *buf = malloc(o->size);
+	long r, lines = 0;
+	ssize_t n, i;
+	double t0, t_ioctl, t_scan;
+
+	if (ioctl(fd, AESDCHAR_IOCGETSTATS, &st) != 0) {
+		perror("AESDCHAR_IOCGETSTATS");
+		return -1;
+	}
+
+	info = calloc(st.capacity, sizeof(struct aesd_entry_info));
+
+	memset(&req, 0, sizeof(req));
+	req.table = (uintptr_t) info;
+	req.max = st.capacity;
+
+	t0 = now_sec();
+	for (r = 0; r < o->records; r++) {
+		if (ioctl(fd, AESDCHAR_IOCGETENTRIES, &req) != 0) {
+			perror("AESDCHAR_IOCGETENTRIES");
+			return -1;
+		}
+	}
+	t_ioctl = now_sec() - t0;
+
+	t0 = now_sec();
+	for (r = 0; r < o->records; r++) {
+		lseek(fd, 0, SEEK_SET);
+		while ((n = read(fd, buf, o->size)) > 0) {
+			for (i = 0; i < n; i++) lines += (buf[i] == '\n');
+		}
+	}
+	t_scan = now_sec() - t0;
+
+	printf("entries  %u entries: %.0f ns/ioctl, %.0f ns/scan (%ld newlines)\n", req.count,
+		t_ioctl * 1e9 / o->records, t_scan * 1e9 / o->records, lines / o->records);
+
+	close(fd);
+	free(info);
+	free(buf);
+
+	return 0;
+}
+
+static int bench_stats(const struct bench_opts *o)
+{
+	int fd = open_device(o->device, O_RDONLY);
+	struct aesd_stats st;
+
+	if (ioctl(fd, AESDCHAR_IOCGETSTATS, &st) != 0) {
+		perror("AESDCHAR_IOCGETSTATS");
+		return -1;
+	}
+
+	printf("entries          %llu / %llu\n", (unsigned long long) st.entries,
+		(unsigned long long) st.capacity);
+	printf("bytes            %llu / %llu\n", (unsigned long long) st.bytes,
+		(unsigned long long) st.max_bytes);
+	printf("evicted          %llu entries, %llu bytes\n", (unsigned long long) st.evicted_entries,
+		(unsigned long long) st.evicted_bytes);
+	printf("chunk allocs     %llu\n", (unsigned long long) st.chunk_allocs);
+	printf("chunk frees      %llu\n", (unsigned long long) st.chunk_frees);
+	printf("chunks recycled  %llu\n", (unsigned long long) st.chunks_recycled);
+	printf("pool chunks      %llu\n", (unsigned long long) st.pool_chunks);
+	printf("ring size        %llu\n", (unsigned long long) st.ring_size);
+	printf("read retries     %llu\n", (unsigned long long) st.read_retries);
+	printf("locked reads     %llu\n", (unsigned long long) st.locked_reads);
+
+	close(fd);
+
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(const struct bench_opts *o);
+} modes[] = {
+	{ "write1", bench_write1 },
+	{ "write", bench_write },
+	{ "writev", bench_writev },
+	{ "read", bench_read },
+	{ "readers", bench_readers },
+	{ "mmap", bench_mmap },
+	{ "writers", bench_writers },
+	{ "shards", bench_shards },
+	{ "send", bench_send },
+	{ "sendfile", bench_sendfile },
+	{ "entries", bench_entries },
+	{ "stats", bench_stats },
+};
+
+static void usage(const char *prog)
+{
+	size_t m;
+
+	fprintf(stderr, "usage: %s [-d device] [-n records] [-s size] [-t threads] [-w] mode\nmodes:", prog);
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) fprintf(stderr, " %s", modes[m].name);
+	fprintf(stderr, "\n");
+	exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_opts o = { DEFAULT_DEVICE, 10000, 128, 8, 0 };
+	size_t m;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:n:s:t:w")) != -1) {
+		switch (opt) {
+			case 'd': o.device = optarg; break;
+			case 'n': o.records = atol(optarg); break;
+			case 's': o.size = strtoul(optarg, NULL, 0); break;
+			case 't': o.threads = atoi(optarg); break;
+			case 'w': o.writer = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc || o.records <= 0 || o.size == 0 || o.threads <= 0) usage(argv[0]);
+
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		if (strcmp(argv[optind], modes[m].name) == 0) return modes[m].run(&o) ? -1 : 0;
+	}
+
+	usage(argv[0]);
+
+	return -1;
+}
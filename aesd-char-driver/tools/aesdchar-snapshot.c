@@ -0,0 +1,121 @@
+/*
+** aesdchar-snapshot.c -- saves and restores the history of an aesdchar device
+*
+*   usage: aesdchar-snapshot save device file
+*          aesdchar-snapshot restore device file
+*
+*   save writes the snapshot of the device (AESDCHAR_IOCSNAPSHOT: the
+*   commands and the pending bytes of an incomplete one) to file; restore
+*   loads it into the device, which must be empty (AESDCHAR_IOCRESTORE).
+*   aesdchar_unload and aesdchar_load use it to keep the history across a
+*   reload of the module.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "../aesd_ioctl.h"
+
+static int save(const char *device, const char *path)
+{
+	struct aesd_snapshot req = { 0, 0 };
+	struct aesd_snapshot_header *hdr;
+	char *buf = NULL;
+	int fd, out;
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		perror(device);
+		return -1;
+	}
+
+	// the first call gives the size, the history may grow until the next one
+	while (ioctl(fd, AESDCHAR_IOCSNAPSHOT, &req) != 0) {
+		if (errno != ENOSPC) {
+			perror("AESDCHAR_IOCSNAPSHOT");
+			return -1;
+		}
+
+		free(buf);
+		buf = malloc(req.size);
+		if (buf == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		req.buf = (uintptr_t) buf;
+	}
+
+	close(fd);
+
+	out = open(path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (out < 0 || write(out, buf, req.size) != (ssize_t) req.size || close(out) != 0) {
+		perror(path);
+		return -1;
+	}
+
+	hdr = (struct aesd_snapshot_header *) buf;
+	printf("%s: %u commands, %llu bytes, %llu pending\n", device, hdr->entries,
+		(unsigned long long) hdr->data_size, (unsigned long long) hdr->pending);
+
+	free(buf);
+
+	return 0;
+}
+
+static int restore(const char *device, const char *path)
+{
+	struct aesd_snapshot req;
+	struct stat st;
+	char *buf;
+	int fd, in;
+
+	in = open(path, O_RDONLY);
+	if (in < 0 || fstat(in, &st) != 0) {
+		perror(path);
+		return -1;
+	}
+
+	buf = malloc(st.st_size);
+	if (buf == NULL || read(in, buf, st.st_size) != st.st_size) {
+		perror(path);
+		return -1;
+	}
+
+	close(in);
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		perror(device);
+		return -1;
+	}
+
+	req.buf = (uintptr_t) buf;
+	req.size = st.st_size;
+
+	if (ioctl(fd, AESDCHAR_IOCRESTORE, &req) != 0) {
+		perror("AESDCHAR_IOCRESTORE");
+		return -1;
+	}
+
+	close(fd);
+	free(buf);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 4 && strcmp(argv[1], "save") == 0) return save(argv[2], argv[3]) ? 1 : 0;
+	if (argc == 4 && strcmp(argv[1], "restore") == 0) return restore(argv[2], argv[3]) ? 1 : 0;
+
+	fprintf(stderr, "usage: %s save|restore device file\n", argv[0]);
+
+	return 1;
+}
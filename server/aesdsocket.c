@@ -13,6 +13,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -23,14 +24,23 @@
 #include <fcntl.h>
 #include <sys/queue.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/sendfile.h>
 
 #include "../aesd-char-driver/aesd_ioctl.h"
+#include "lz.h"
 
 #define LISTEN_PORT "9000"  
 #define MAX_BUF 1024
+#define SENDFILE_CHUNK (64 * 1024) // replay bytes per sendfile() call
 #define MAX_PACKET_BUF 65000
 
-#define USE_AESD_CHAR_DEVICE 1
+// history backend, chosen at build time: make USE_AESD_CHAR_DEVICE=1 (the
+// default) keeps it in /dev/aesdchar, make USE_AESD_CHAR_DEVICE=0 in a file,
+// the backend the -f durability modes apply to
 
 #ifdef USE_AESD_CHAR_DEVICE
 #define SAVE_FILE "/dev/aesdchar"
@@ -41,6 +51,26 @@
 
 #define BACKLOG 10	 // how many pending connections queue will hold
 
+// unix socket used to pass the listening socket to a new binary (hot upgrade)
+#define HANDOFF_SOCKET "/var/tmp/aesdsocket.handoff"
+
+// command returning the admission control counters instead of the history
+#define STATS_COMMAND "AESDSOCKET_STATS"
+
+// time range replay commands, times are seconds since the epoch
+//   AESDSOCKET_SINCE:<t>          lines that arrived at or after t
+//   AESDSOCKET_BETWEEN:<t1>,<t2>  lines that arrived within [t1, t2]
+#define SINCE_COMMAND "AESDSOCKET_SINCE:"
+#define BETWEEN_COMMAND "AESDSOCKET_BETWEEN:"
+
+// compressed replay negotiation, AESDSOCKET_COMPRESS:1 (on) or :0 (off)
+// once on, every replay is sent as frames of
+//   [raw length BE32][payload length BE32][payload]
+// the payload is lz compressed, or stored as is when payload length equals
+// raw length, and a frame with raw length 0 ends the replay
+#define COMPRESS_COMMAND "AESDSOCKET_COMPRESS:"
+#define ZBLOCK (64 * 1024)
+
 typedef struct slist_data_s slist_date_t;
 
 struct slist_data_s {
@@ -57,15 +87,77 @@ SLIST_HEAD(slisthead, slist_data_s) head;
 
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+// admission control: global budgets (0 = unlimited) and rejection counters
+
+struct budget_s {
+	long max_sessions;   // -s : concurrent sessions
+	long max_inflight;   // -b : bytes buffered by all sessions, not yet saved
+	long max_client;     // -c : bytes buffered by one session
+	long max_replay;     // -r : replay bandwidth in bytes per second
+
+	long sessions;
+	long inflight;
+	double replay_tokens;
+	struct timespec replay_stamp;
+
+	unsigned long rejected_sessions;  // connection closed right after accept
+	unsigned long deferred_lines;     // line start waited for in-flight budget
+	unsigned long discarded_packets;  // per-client buffer overflow
+	unsigned long throttled_replays;  // replay chunk waited for bandwidth
+};
+
+struct budget_s budget = { .max_client = MAX_PACKET_BUF };
+
+pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t budget_cond = PTHREAD_COND_INITIALIZER;
+
+// durability of the file backend, a line is acknowledged (history sent back)
+// only once it is as durable as the selected mode requires
+
+enum durable_mode {
+	DURABLE_NONE,      // write only, the page cache decides
+	DURABLE_INTERVAL,  // fdatasync every interval_ms by a flusher thread
+	DURABLE_GROUP,     // one fdatasync covers every line written meanwhile
+	DURABLE_DSYNC,     // file opened with O_DSYNC, each write is durable
+};
+
+const char *durable_names[] = { "none", "interval", "group", "dsync" };
+
+struct durable_s {
+	enum durable_mode mode;
+	long interval_ms;
+
+	unsigned long written_seq;  // lines written to the file
+	unsigned long synced_seq;   // lines covered by a completed fdatasync
+	bool syncing;
+
+	// commit latency (write + durability wait) for the selected mode
+	unsigned long commits;
+	unsigned long fsyncs;
+	double latency_total_us;
+	double latency_max_us;
+};
+
+struct durable_s durable = { .mode = DURABLE_NONE };
+
+pthread_mutex_t durable_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER;
+
 // file descriptor
 int frw = -1; //, fw = -1, fr = -1;
 
+// hot upgrade listener (-1 if not available)
+int fd_handoff = -1;
+
 // control threads
 bool exit_triggered = false;
 
 // thread function
 void *session_handler(void *);
 //
+void budget_replay(size_t n); // replay bandwidth budget
+void budget_replay_refund(size_t n);
+//
 void clean_up(); // free resources
 
 /* Signal Handlers */
@@ -81,7 +173,14 @@ static void exit_signal_handler (int signo)
 	//if (fw != -1) close(fw);
 	if (frw != -1) close(frw);
 
-	remove(SAVE_FILE); // delete the file
+#ifndef USE_AESD_CHAR_DEVICE
+	remove(SAVE_FILE); // delete the file (never the device node)
+#endif
+
+	if (fd_handoff != -1) {
+		close(fd_handoff);
+		unlink(HANDOFF_SOCKET);
+	}
 
 	//
 	if (signo == SIGINT) 
@@ -113,6 +212,9 @@ void catch_signals()
 		fprintf(stderr, "Cannot handle SIGTERM!\n");
 		exit(-1);
 	}
+
+	// a client closing during a replay must not kill the server
+	signal(SIGPIPE, SIG_IGN);
 }
 
 /* Socket Utilities */
@@ -201,6 +303,778 @@ bool bind_socket(int* fdp) {
 		return true;
 }
 
+/* Hot Upgrade (listening socket handoff) */
+
+// listen on HANDOFF_SOCKET for a new binary asking for the listening socket
+
+bool handoff_listen()
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd == -1) {
+		perror("handoff: socket");
+		return false;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, HANDOFF_SOCKET, sizeof(addr.sun_path) - 1);
+
+	unlink(HANDOFF_SOCKET); // stale path left by a crashed process
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+		perror("handoff: bind");
+		close(fd);
+		return false;
+	}
+
+	fd_handoff = fd;
+
+	return true;
+}
+
+// connect to the running server and receive its listening socket (SCM_RIGHTS)
+
+bool handoff_receive(int *fdp)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	char tag;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd == -1) {
+		perror("handoff: socket");
+		return false;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, HANDOFF_SOCKET, sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		perror("handoff: connect");
+		close(fd);
+		return false;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &tag;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if (recvmsg(fd, &msg, 0) <= 0) {
+		perror("handoff: recvmsg");
+		close(fd);
+		return false;
+	}
+
+	close(fd);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "handoff: no socket received\n");
+		return false;
+	}
+
+	memcpy(fdp, CMSG_DATA(cmsg), sizeof(int));
+
+	return true;
+}
+
+// pass the listening socket to the new binary connected on fd_handoff
+
+bool handoff_send(int fd_server)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	char tag = 'L';
+	int fd, rc;
+
+	fd = accept(fd_handoff, NULL, NULL);
+
+	if (fd == -1) {
+		perror("handoff: accept");
+		return false;
+	}
+
+	// release the path so that the new process can listen on it
+	close(fd_handoff);
+	fd_handoff = -1;
+	unlink(HANDOFF_SOCKET);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = &tag;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd_server, sizeof(int));
+
+	rc = sendmsg(fd, &msg, 0);
+
+	close(fd);
+
+	if (rc == -1) {
+		perror("handoff: sendmsg");
+		handoff_listen(); // keep serving, allow another attempt
+		return false;
+	}
+
+	return true;
+}
+
+
+/* History Index */
+
+// every committed line gets a sequence number (first_seq + position in recs)
+// and an arrival time, kept in arrival order so time lookups are a binary search
+
+struct hist_rec_s {
+	int64_t time_ns;  // arrival time (CLOCK_REALTIME), never decreasing
+	uint64_t offs;    // offset of the line in the history stream
+};
+
+struct hist_index_s {
+	struct hist_rec_s *recs;
+	size_t n, cap;
+	unsigned long first_seq;
+	uint64_t end;     // offset after the last line (history size found at open + written)
+};
+
+struct hist_index_s hist;  // protected by lock
+
+// open the history (file or device), the index starts after what is already there
+
+void open_history()
+{
+	off_t size;
+
+	if (frw != -1) return;
+
+#ifdef USE_AESD_CHAR_DEVICE
+	frw = open(SAVE_FILE, O_RDWR, S_IRWXU | S_IRWXG | S_IRWXO);
+#else
+	frw = open(SAVE_FILE, O_CREAT | O_RDWR | O_APPEND | (durable.mode == DURABLE_DSYNC ? O_DSYNC : 0),
+		S_IRWXU | S_IRWXG | S_IRWXO);
+#endif
+
+	if (frw == -1) return;
+
+	size = lseek(frw, 0, SEEK_END);
+	lseek(frw, 0, SEEK_SET);
+
+	if (size > 0 && hist.end == 0) hist.end = size;
+}
+
+// offset of the first byte still held by the history (the device evicts old
+// lines, assuming this server is its only writer), drops evicted records once
+// most of the index is evicted: *kept (if not NULL) is set to the index of
+// the first record still held, the records before it must not be used
+
+uint64_t hist_start(size_t *kept)
+{
+	off_t size = lseek(frw, 0, SEEK_END);
+	uint64_t start;
+	size_t lo = 0, hi = hist.n, mid;
+
+	lseek(frw, 0, SEEK_SET);
+
+	start = (size >= 0 && (uint64_t) size < hist.end) ? hist.end - size : 0;
+
+	// first record not evicted
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (hist.recs[mid].offs < start) lo = mid + 1;
+		else hi = mid;
+	}
+
+	// compact once most of the index is evicted
+	if (lo > 0 && lo >= hist.n / 2) {
+		memmove(hist.recs, hist.recs + lo, (hist.n - lo) * sizeof(struct hist_rec_s));
+		hist.n -= lo;
+		hist.first_seq += lo;
+		lo = 0;
+	}
+
+	if (kept != NULL) *kept = lo;
+
+	return start;
+}
+
+// index a line of size bytes just written
+
+void hist_append(size_t size)
+{
+	struct hist_rec_s *recs;
+	struct timespec now;
+	int64_t ns;
+
+	if (hist.n == hist.cap) {
+		if (hist.n > 0) hist_start(NULL); // make room by dropping evicted records first
+	}
+
+	if (hist.n == hist.cap) {
+		recs = realloc(hist.recs, (hist.cap ? hist.cap * 2 : 1024) * sizeof(struct hist_rec_s));
+		if (recs == NULL) {
+			perror("hist: realloc");
+			hist.end += size;
+			return;
+		}
+		hist.recs = recs;
+		hist.cap = hist.cap ? hist.cap * 2 : 1024;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	ns = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+	// keep the index sorted even if the wall clock steps back
+	if (hist.n > 0 && ns < hist.recs[hist.n - 1].time_ns) ns = hist.recs[hist.n - 1].time_ns;
+
+	hist.recs[hist.n].time_ns = ns;
+	hist.recs[hist.n].offs = hist.end;
+	hist.n++;
+
+	hist.end += size;
+}
+
+// first record that arrived at or after time_ns (hist.n if none)
+
+size_t hist_lower_bound(int64_t time_ns)
+{
+	size_t lo = 0, hi = hist.n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (hist.recs[mid].time_ns < time_ns) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+// parse seconds since the epoch at s, *end set past them; false if there is
+// no number or it is out of range
+
+bool parse_time(const char *s, char **end, int64_t *ns)
+{
+	double t = strtod(s, end);
+
+	if (*end == s || !(t >= 0 && t < INT64_MAX / 1e9)) return false;
+
+	*ns = (int64_t) (t * 1e9);
+
+	return true;
+}
+
+// true if s holds nothing but whitespace
+
+bool only_spaces(const char *s)
+{
+	while (isspace((unsigned char) *s)) s++;
+
+	return *s == '\0';
+}
+
+// parse a SINCE or BETWEEN command of len bytes (without newline): 1 if
+// valid, -1 if malformed (not a time, trailing characters, from after to),
+// 0 if packet is not a time range command
+
+int parse_range_command(const char *packet, int len, int64_t *from_ns, int64_t *to_ns)
+{
+	char arg[64];
+	char *sep;
+	int n;
+
+	if (len > strlen(SINCE_COMMAND) && strncmp(packet, SINCE_COMMAND, strlen(SINCE_COMMAND)) == 0) {
+		n = strlen(SINCE_COMMAND);
+	} else if (len > strlen(BETWEEN_COMMAND) && strncmp(packet, BETWEEN_COMMAND, strlen(BETWEEN_COMMAND)) == 0) {
+		n = strlen(BETWEEN_COMMAND);
+	} else {
+		return 0;
+	}
+
+	if (len - n >= sizeof(arg)) return -1;
+
+	memcpy(arg, packet + n, len - n);
+	arg[len - n] = '\0';
+
+	if (!parse_time(arg, &sep, from_ns)) return -1;
+	*to_ns = INT64_MAX;
+
+	if (n == strlen(BETWEEN_COMMAND)) {
+		if (*sep != ',' || !parse_time(sep + 1, &sep, to_ns)) return -1;
+	}
+
+	if (!only_spaces(sep) || *from_ns > *to_ns) return -1;
+
+	return 1;
+}
+
+// history positions [*pos, *end) of the lines that arrived within [from_ns, to_ns]
+// call with lock held, false if no line matches
+
+bool hist_range(int64_t from_ns, int64_t to_ns, off_t *pos, off_t *end)
+{
+	size_t kept, first, last;
+	uint64_t start = hist_start(&kept);
+
+	// evicted lines are no longer in the history, whatever their time
+	first = hist_lower_bound(from_ns);
+	last = (to_ns == INT64_MAX) ? hist.n : hist_lower_bound(to_ns + 1);
+	if (first < kept) first = kept;
+	if (last < kept) last = kept;
+
+	if (first >= last) return false;
+
+	*pos = hist.recs[first].offs - start;
+	*end = (last < hist.n ? hist.recs[last].offs : hist.end) - start;
+
+	return true;
+}
+
+/* Compressed History */
+
+// the history is append-only, so the ZBLOCK aligned block at a given stream
+// offset never changes once complete: it is compressed once and kept in
+// memory for every compressed replay
+
+struct zblock_s {
+	char *data;  // NULL until compressed
+	uint32_t size;
+};
+
+struct zstore_s {
+	struct zblock_s *blocks;  // blocks[i] holds stream block first_block + i
+	size_t n;
+	uint64_t first_block;
+
+	unsigned long raw_bytes;     // history bytes held compressed
+	unsigned long stored_bytes;  // their compressed size
+	unsigned long replay_raw;    // history bytes sent by compressed replays
+	unsigned long replay_sent;   // bytes actually sent for them
+};
+
+struct zstore_s zstore;
+
+pthread_mutex_t zstore_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// copy compressed block blockno to dst, returns its size or 0 if not stored
+
+uint32_t zstore_get(uint64_t blockno, char *dst)
+{
+	uint32_t size = 0;
+
+	pthread_mutex_lock(&zstore_lock);
+
+	if (blockno >= zstore.first_block && blockno - zstore.first_block < zstore.n
+		&& zstore.blocks[blockno - zstore.first_block].data != NULL) {
+		size = zstore.blocks[blockno - zstore.first_block].size;
+		memcpy(dst, zstore.blocks[blockno - zstore.first_block].data, size);
+	}
+
+	pthread_mutex_unlock(&zstore_lock);
+
+	return size;
+}
+
+// free the blocks evicted from the history (before stream offset start)
+
+void zstore_trim(uint64_t start)
+{
+	size_t drop = 0;
+
+	while (drop < zstore.n && (zstore.first_block + drop + 1) * ZBLOCK <= start) {
+		if (zstore.blocks[drop].data != NULL) {
+			zstore.raw_bytes -= ZBLOCK;
+			zstore.stored_bytes -= zstore.blocks[drop].size;
+			free(zstore.blocks[drop].data);
+		}
+		drop++;
+	}
+
+	if (drop > 0) {
+		memmove(zstore.blocks, zstore.blocks + drop, (zstore.n - drop) * sizeof(struct zblock_s));
+		zstore.n -= drop;
+		zstore.first_block += drop;
+	}
+}
+
+// keep a copy of compressed block blockno, history starting at stream offset start
+
+void zstore_put(uint64_t blockno, uint64_t start, const char *data, uint32_t size)
+{
+	struct zblock_s *blocks;
+	size_t n;
+
+	pthread_mutex_lock(&zstore_lock);
+
+	zstore_trim(start);
+
+	if (zstore.n == 0) zstore.first_block = blockno;
+
+	if (blockno < zstore.first_block) goto out;
+
+	// grow to cover blockno
+	n = blockno - zstore.first_block + 1;
+	if (n > zstore.n) {
+		blocks = realloc(zstore.blocks, n * sizeof(struct zblock_s));
+		if (blocks == NULL) goto out;
+		memset(blocks + zstore.n, 0, (n - zstore.n) * sizeof(struct zblock_s));
+		zstore.blocks = blocks;
+		zstore.n = n;
+	}
+
+	if (zstore.blocks[n - 1].data == NULL) {
+		zstore.blocks[n - 1].data = malloc(size);
+		if (zstore.blocks[n - 1].data != NULL) {
+			memcpy(zstore.blocks[n - 1].data, data, size);
+			zstore.blocks[n - 1].size = size;
+			zstore.raw_bytes += ZBLOCK;
+			zstore.stored_bytes += size;
+		}
+	}
+
+out:
+	pthread_mutex_unlock(&zstore_lock);
+}
+
+// send one replay frame, stored as is if it does not compress
+
+bool send_frame(int fd_client, const char *raw, uint32_t raw_len, const char *comp, uint32_t comp_len)
+{
+	uint32_t header[2];
+
+	if (comp_len == 0 || comp_len >= raw_len) {
+		comp = raw;
+		comp_len = raw_len;
+	}
+
+	header[0] = htonl(raw_len);
+	header[1] = htonl(comp_len);
+
+	budget_replay(sizeof(header) + comp_len);
+
+	if (send(fd_client, header, sizeof(header), MSG_MORE) == -1
+		|| (comp_len > 0 && send(fd_client, comp, comp_len, 0) == -1)) {
+		perror("send");
+		return false;
+	}
+
+	pthread_mutex_lock(&zstore_lock);
+	zstore.replay_raw += raw_len;
+	zstore.replay_sent += sizeof(header) + comp_len;
+	pthread_mutex_unlock(&zstore_lock);
+
+	return true;
+}
+
+/* Admission Control */
+
+// reserve a session slot, false if the session budget is exhausted
+
+bool budget_session_begin()
+{
+	bool admitted = true;
+
+	pthread_mutex_lock(&budget_lock);
+
+	if (budget.max_sessions > 0 && budget.sessions >= budget.max_sessions) {
+		budget.rejected_sessions++;
+		admitted = false;
+	} else {
+		budget.sessions++;
+	}
+
+	pthread_mutex_unlock(&budget_lock);
+
+	return admitted;
+}
+
+void budget_session_end()
+{
+	pthread_mutex_lock(&budget_lock);
+	budget.sessions--;
+	pthread_mutex_unlock(&budget_lock);
+}
+
+// wait until a new line may be buffered within the in-flight budget
+
+void budget_line_wait()
+{
+	bool deferred = false;
+
+	pthread_mutex_lock(&budget_lock);
+
+	while (budget.max_inflight > 0 && budget.inflight >= budget.max_inflight && !exit_triggered) {
+		if (!deferred) {
+			budget.deferred_lines++;
+			deferred = true;
+		}
+		pthread_cond_wait(&budget_cond, &budget_lock);
+	}
+
+	pthread_mutex_unlock(&budget_lock);
+}
+
+// account bytes buffered (n > 0) or released (n < 0) by a session
+
+void budget_inflight(long n)
+{
+	pthread_mutex_lock(&budget_lock);
+
+	budget.inflight += n;
+
+	if (n < 0) pthread_cond_broadcast(&budget_cond);
+
+	pthread_mutex_unlock(&budget_lock);
+}
+
+void budget_discarded()
+{
+	pthread_mutex_lock(&budget_lock);
+	budget.discarded_packets++;
+	pthread_mutex_unlock(&budget_lock);
+}
+
+// token bucket shared by all replays, sleeps until n bytes may be sent
+
+void budget_replay(size_t n)
+{
+	struct timespec now, delay;
+	double wait = 0;
+
+	if (budget.max_replay <= 0) return;
+
+	pthread_mutex_lock(&budget_lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// refill, allowing bursts of up to one second
+	budget.replay_tokens += budget.max_replay * ((now.tv_sec - budget.replay_stamp.tv_sec)
+		+ (now.tv_nsec - budget.replay_stamp.tv_nsec) / 1e9);
+	if (budget.replay_tokens > budget.max_replay) budget.replay_tokens = budget.max_replay;
+	budget.replay_stamp = now;
+
+	budget.replay_tokens -= n;
+
+	if (budget.replay_tokens < 0) {
+		budget.throttled_replays++;
+		wait = -budget.replay_tokens / budget.max_replay;
+	}
+
+	pthread_mutex_unlock(&budget_lock);
+
+	if (wait > 0) {
+		delay.tv_sec = (time_t) wait;
+		delay.tv_nsec = (long) ((wait - delay.tv_sec) * 1e9);
+		nanosleep(&delay, NULL);
+	}
+}
+
+// give back tokens charged by budget_replay for bytes that were not sent
+
+void budget_replay_refund(size_t n)
+{
+	if (budget.max_replay <= 0 || n == 0) return;
+
+	pthread_mutex_lock(&budget_lock);
+	budget.replay_tokens += n;
+	pthread_mutex_unlock(&budget_lock);
+}
+
+/* Durability */
+
+// parse -f none | interval:<ms> | group | dsync
+
+bool durable_parse(const char *arg)
+{
+	if (strcmp(arg, "none") == 0) {
+		durable.mode = DURABLE_NONE;
+	} else if (strncmp(arg, "interval:", 9) == 0 && atol(arg + 9) > 0) {
+		durable.mode = DURABLE_INTERVAL;
+		durable.interval_ms = atol(arg + 9);
+	} else if (strcmp(arg, "group") == 0) {
+		durable.mode = DURABLE_GROUP;
+	} else if (strcmp(arg, "dsync") == 0) {
+		durable.mode = DURABLE_DSYNC;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+// fdatasync everything written so far, called with durable_lock held
+
+void durable_sync_locked()
+{
+	unsigned long target = durable.written_seq;
+	int fd = frw;
+
+	durable.syncing = true;
+	pthread_mutex_unlock(&durable_lock);
+
+	if (fd != -1 && fdatasync(fd) == -1) {
+		perror("fdatasync");
+	}
+
+	pthread_mutex_lock(&durable_lock);
+	durable.syncing = false;
+	durable.fsyncs++;
+	if (target > durable.synced_seq) durable.synced_seq = target;
+	pthread_cond_broadcast(&durable_cond);
+}
+
+// count a line written to the file, returns its sequence number
+
+unsigned long durable_written()
+{
+	unsigned long seq;
+
+	pthread_mutex_lock(&durable_lock);
+	seq = ++durable.written_seq;
+	pthread_mutex_unlock(&durable_lock);
+
+	return seq;
+}
+
+// wait until line seq is durable, then account the commit latency
+
+void durable_wait(unsigned long seq, struct timespec *start)
+{
+	struct timespec now;
+	double us;
+
+	pthread_mutex_lock(&durable_lock);
+
+	if (durable.mode == DURABLE_INTERVAL || durable.mode == DURABLE_GROUP) {
+		while (durable.synced_seq < seq && !exit_triggered) {
+			// group commit: the first waiter syncs for everybody queued behind it
+			if (durable.mode == DURABLE_GROUP && !durable.syncing) {
+				durable_sync_locked();
+			} else {
+				pthread_cond_wait(&durable_cond, &durable_lock);
+			}
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+
+	durable.commits++;
+	durable.latency_total_us += us;
+	if (us > durable.latency_max_us) durable.latency_max_us = us;
+
+	pthread_mutex_unlock(&durable_lock);
+}
+
+// flusher thread for DURABLE_INTERVAL
+
+void *durable_flusher(void *unused)
+{
+	struct timespec delay;
+
+	delay.tv_sec = durable.interval_ms / 1000;
+	delay.tv_nsec = (durable.interval_ms % 1000) * 1000000;
+
+	while (!exit_triggered) {
+		nanosleep(&delay, NULL);
+
+		pthread_mutex_lock(&durable_lock);
+		if (durable.synced_seq < durable.written_seq && !durable.syncing) {
+			durable_sync_locked();
+		}
+		pthread_mutex_unlock(&durable_lock);
+	}
+
+	return NULL;
+}
+
+// write the budgets and counters to a client
+
+void send_stats(int fd_client)
+{
+	char buf[1024];
+	int n;
+
+	pthread_mutex_lock(&budget_lock);
+
+	n = snprintf(buf, sizeof(buf),
+		"sessions: %ld/%ld\n"
+		"inflight_bytes: %ld/%ld\n"
+		"client_bytes_max: %ld\n"
+		"replay_rate_max: %ld\n"
+		"rejected_sessions: %lu\n"
+		"deferred_lines: %lu\n"
+		"discarded_packets: %lu\n"
+		"throttled_replays: %lu\n",
+		budget.sessions, budget.max_sessions,
+		budget.inflight, budget.max_inflight,
+		budget.max_client, budget.max_replay,
+		budget.rejected_sessions, budget.deferred_lines,
+		budget.discarded_packets, budget.throttled_replays);
+
+	pthread_mutex_unlock(&budget_lock);
+
+	pthread_mutex_lock(&durable_lock);
+
+	n += snprintf(buf + n, sizeof(buf) - n,
+		"durability: %s\n"
+		"commits: %lu\n"
+		"fsyncs: %lu\n"
+		"commit_latency_avg_us: %.1f\n"
+		"commit_latency_max_us: %.1f\n",
+		durable_names[durable.mode], durable.commits, durable.fsyncs,
+		durable.commits ? durable.latency_total_us / durable.commits : 0.0,
+		durable.latency_max_us);
+
+	pthread_mutex_unlock(&durable_lock);
+
+	pthread_mutex_lock(&lock);
+
+	n += snprintf(buf + n, sizeof(buf) - n,
+		"history_first_seq: %lu\n"
+		"history_next_seq: %lu\n",
+		hist.first_seq, hist.first_seq + hist.n);
+
+	pthread_mutex_unlock(&lock);
+
+	pthread_mutex_lock(&zstore_lock);
+
+	n += snprintf(buf + n, sizeof(buf) - n,
+		"zstore_raw_bytes: %lu\n"
+		"zstore_bytes: %lu\n"
+		"compressed_replay_raw_bytes: %lu\n"
+		"compressed_replay_sent_bytes: %lu\n",
+		zstore.raw_bytes, zstore.stored_bytes, zstore.replay_raw, zstore.replay_sent);
+
+	pthread_mutex_unlock(&zstore_lock);
+
+	if (send(fd_client, buf, n, 0) == -1) {
+		perror("send");
+	}
+}
 
 bool save_to_file(char* packet, int size) {
 	int rc;
@@ -208,13 +1082,7 @@ bool save_to_file(char* packet, int size) {
 	ssize_t nr;
 	int route;
 
-    if (frw == -1) { 
-#ifdef USE_AESD_CHAR_DEVICE
-		frw = open(SAVE_FILE, O_RDWR, S_IRWXU | S_IRWXG | S_IRWXO);
-#else
-		frw = open(SAVE_FILE, O_CREAT | O_RDWR | O_APPEND, S_IRWXU | S_IRWXG | S_IRWXO);
-#endif
-	}
+	open_history();
 
 	if (frw == -1) {
 		perror("open");
@@ -238,6 +1106,8 @@ bool save_to_file(char* packet, int size) {
 		route = 1;
 		nr = write(frw, packet, size);
 		lseek(frw, 0, SEEK_SET);
+
+		if (nr > 0) hist_append(nr);
 	}
 
 	//close(frw);
@@ -266,6 +1136,8 @@ void accept_loop(int fd_server)
 
 	pthread_t thread_id;
 	struct slist_data_s *datap = NULL;
+	struct pollfd pfds[2];
+	bool handed_off = false;
 
 
 #ifdef USE_AESD_CHAR_DEVICE
@@ -275,6 +1147,27 @@ void accept_loop(int fd_server)
 #endif
 
 	while(!exit_triggered) {  
+		// wait for a client or for a new binary asking for the socket
+		pfds[0].fd = fd_server;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = fd_handoff; // ignored by poll when -1
+		pfds[1].events = POLLIN;
+
+		if (poll(pfds, 2, -1) == -1) {
+			// interrupted by a signal
+			continue;
+		}
+
+		if (fd_handoff != -1 && (pfds[1].revents & POLLIN)) {
+			if (handoff_send(fd_server)) {
+				handed_off = true;
+				break;
+			}
+			continue;
+		}
+
+		if (!(pfds[0].revents & POLLIN)) continue;
+
 		// accept a connection
 		fd_client = accept(fd_server, (struct sockaddr *)&client_addr, &sin_size); 
 
@@ -285,6 +1178,13 @@ void accept_loop(int fd_server)
 
 		printf("new connection: %d\n", fd_client);
 
+		// load shedding: reject fast instead of queueing behind a busy server
+		if (!budget_session_begin()) {
+			printf("server: session budget exhausted, connection rejected\n");
+			close(fd_client);
+			continue;
+		}
+
 		// address
 		inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr), s, sizeof s); 
 
@@ -298,8 +1198,9 @@ void accept_loop(int fd_server)
 		// create thread
 		rc = pthread_create(&thread_id, NULL, session_handler, (void *) datap);
 
-		if (rc < 0) {
+		if (rc != 0) {
 			perror("Could not create thread");
+			budget_session_end();
 			free(datap); // release the allocatied memory
 			break; // someting wrong -> exit
 		}
@@ -326,6 +1227,21 @@ void accept_loop(int fd_server)
 		}
 	} 
 
+	if (handed_off) {
+		// the new process accepts from now on, drain our sessions and leave
+		// the history (file or device) untouched
+		close(fd_server);
+
+		printf("server: listening socket handed off, draining sessions\n");
+		syslog(LOG_DEBUG, "Listening socket handed off, draining sessions");
+
+		clean_up(); // pthread_join here
+
+		if (frw != -1) close(frw);
+
+		exit(EXIT_SUCCESS);
+	}
+
 	//
 	clean_up();
 }
@@ -350,107 +1266,303 @@ void clean_up()
 	}
 }
 
+// send history bytes [pos, end) to the client (end < 0: up to the end),
+// nothing if pos < 0. The bytes go through sendfile() so they never cross
+// into userspace; if the history file can't be spliced (older driver
+// without splice_read), fall back to pread + send for good.
+
+static bool use_sendfile = true;
+
+void replay_history(int fd_client, off_t pos, off_t end, char *buf)
+{
+	ssize_t n_read, rc;
+	size_t n, cap;
+
+	while(use_sendfile && pos >= 0 && (end < 0 || pos < end)) {
+		n = (end < 0 || end - pos > SENDFILE_CHUNK) ? SENDFILE_CHUNK : end - pos;
+
+		// under a replay budget, no more than a tenth of a second of it per
+		// call, charged before sending as the pread path does
+		cap = (budget.max_replay / 10 > MAX_BUF) ? budget.max_replay / 10 : MAX_BUF;
+		if (budget.max_replay > 0 && n > cap) n = cap;
+		budget_replay(n);
+
+		// advances pos by the bytes sent
+		rc = sendfile(fd_client, frw, &pos, n);
+
+		// the end of the history may come before n bytes
+		budget_replay_refund(rc > 0 ? n - rc : n);
+
+		if (rc == -1) {
+			if (errno == EINVAL || errno == ENOSYS) {
+				use_sendfile = false;
+				break;
+			}
+			perror("sendfile");
+			return;
+		}
+
+		if (rc == 0) return;
+	}
+
+	while(pos >= 0 && (end < 0 || pos < end)) {
+		n = (end < 0 || end - pos > MAX_BUF) ? MAX_BUF : end - pos;
+
+		//n_read = read(fr, recv_buf, MAX_BUF);
+		n_read = pread(frw, buf, n, pos);
+
+		if (n_read == -1) {
+			perror("read");
+			break;
+		}
+
+		if (n_read > 0) {
+			pos += n_read;
+			budget_replay(n_read);
+			rc = send(fd_client, buf, n_read, 0);
+			if (rc == -1) {
+				perror("send");
+				break;
+			}
+		} else {
+			break;
+		}
+	}
+	//close(fr);
+
+	//fr = -1; // for signal handler
+}
+
+// compressed replay of history bytes [pos, end), history byte 0 being at
+// stream offset start, raw and comp are ZBLOCK and LZ_BOUND(ZBLOCK) buffers
+
+void replay_history_compressed(int fd_client, off_t pos, off_t end, uint64_t start, char *raw, char *comp)
+{
+	uint64_t abs, abs_end, blockno, boundary, cur_start;
+	size_t len;
+	ssize_t n_read;
+	uint32_t z;
+
+	abs = start + pos;
+	abs_end = start + end;
+
+	while (pos >= 0 && abs < abs_end) {
+		blockno = abs / ZBLOCK;
+		boundary = (blockno + 1) * ZBLOCK;
+		len = (boundary < abs_end ? boundary : abs_end) - abs;
+
+		// complete blocks are served from the store
+		if (len == ZBLOCK && (z = zstore_get(blockno, comp)) > 0) {
+			if (!send_frame(fd_client, NULL, ZBLOCK, comp, z)) goto broken;
+			abs += len;
+			continue;
+		}
+
+		n_read = pread(frw, raw, len, abs - start);
+
+		if (n_read <= 0) {
+			if (n_read == -1) perror("read");
+			break;
+		}
+
+		z = lz_compress(raw, n_read, comp, LZ_BOUND(ZBLOCK));
+
+		// a block which does not compress is sent raw, so it is not stored
+		// (a stored block must be sendable without its raw bytes)
+		if (n_read == ZBLOCK && z > 0 && z < ZBLOCK) {
+			// only if no eviction shifted the history while reading
+			pthread_mutex_lock(&lock);
+			cur_start = hist_start(NULL);
+			pthread_mutex_unlock(&lock);
+
+			if (cur_start == start) zstore_put(blockno, start, comp, z);
+		}
+
+		if (!send_frame(fd_client, raw, n_read, comp, z)) goto broken;
+
+		abs += n_read;
+	}
+
+	// end of replay
+	if (send_frame(fd_client, NULL, 0, NULL, 0)) return;
+
+broken:
+	// a frame is missing, the client could not resync: end the session
+	shutdown(fd_client, SHUT_RDWR);
+}
+
 void* session_handler(void* dp)
 {
-	char packet_buf[MAX_PACKET_BUF], recv_buf[MAX_BUF];
+	char *packet_buf, recv_buf[MAX_BUF];
 	int n_packet = 0, n_recv;
-	int i, pos_newline, rc, n_read;
+	int i, pos_newline, range;
 	int fd_client = -1;
+	off_t pos, end;
+	bool is_stats, is_range, is_compress, compressed = false;
+	int64_t from_ns, to_ns;
+	uint64_t stream_start = 0;
+	char *zraw = NULL, *zcomp = NULL;
+	unsigned long seq;
+	struct timespec start;
 
 	struct slist_data_s *datap = (struct slist_data_s *) dp;
 	fd_client = datap->fd_client;
 
-	while(!exit_triggered) {
+	// per-client buffer sized by the budget (not on the thread stack)
+	packet_buf = malloc(budget.max_client);
+
+	if (packet_buf == NULL) {
+		perror("malloc");
+	}
+
+	while(packet_buf != NULL && !exit_triggered) {
+		// a new line waits for the in-flight budget, a started one may complete
+		if (n_packet == 0) budget_line_wait();
+
 		n_recv = recv(fd_client, recv_buf, MAX_BUF, 0);
 
 		// socket closed
-		if (n_recv == 0) {
+		if (n_recv <= 0) {
 			printf("server: closed connection from %s\n", datap->addr); 
 			syslog(LOG_DEBUG, "Closed connection from %s", datap->addr);
 			break;
 		}
 
 		// check buffer full
-		if (n_packet + n_recv > MAX_PACKET_BUF) {
+		if (n_packet + n_recv > budget.max_client) {
 			printf("Buffer full. Packet is discarded\n");
+			budget_inflight(-n_packet);
+			budget_discarded();
 			n_packet = 0;
 			continue;
 		} 
 
+		budget_inflight(n_recv);
+
 		// copy to master buffer
 		memcpy(packet_buf + n_packet, recv_buf, n_recv);
 		n_packet += n_recv;
 
 		printf("%d characters received, total = %d\n", n_recv, n_packet);
 
-		// check packet ending
-		pos_newline = -1;
+		// handle every completed packet in the buffer
+		while(1) {
+			// check packet ending
+			pos_newline = -1;
 
-		for(i = 0; i < n_packet; i++) {
+			for(i = 0; i < n_packet; i++) {
 
-		    //printf("[%d]%c", i, packet_buf[i]);
+			    //printf("[%d]%c", i, packet_buf[i]);
 
-			if (packet_buf[i] == '\n') {
-				pos_newline = i;
-				break;
+				if (packet_buf[i] == '\n') {
+					pos_newline = i;
+					break;
+				}
+			}
+
+			// packet completed
+			if (pos_newline < 0) break;
+
+			is_stats = (pos_newline == strlen(STATS_COMMAND)
+				&& strncmp(packet_buf, STATS_COMMAND, pos_newline) == 0);
+			range = parse_range_command(packet_buf, pos_newline, &from_ns, &to_ns);
+			is_range = (range != 0);
+			is_compress = (pos_newline == strlen(COMPRESS_COMMAND) + 1
+				&& strncmp(packet_buf, COMPRESS_COMMAND, strlen(COMPRESS_COMMAND)) == 0);
+
+			if (is_compress) {
+				compressed = (packet_buf[pos_newline - 1] == '1');
+
+				if (compressed && zraw == NULL) {
+					zraw = malloc(ZBLOCK);
+					zcomp = malloc(LZ_BOUND(ZBLOCK));
+					if (zraw == NULL || zcomp == NULL) {
+						perror("malloc");
+						compressed = false;
+					}
+				}
+
+				// acknowledge with the mode in effect
+				if (send(fd_client, compressed ? COMPRESS_COMMAND "1\n" : COMPRESS_COMMAND "0\n",
+					strlen(COMPRESS_COMMAND) + 2, 0) == -1) {
+					perror("send");
+				}
+			} else if (is_stats) {
+				send_stats(fd_client);
+			} else if (!is_range) {
+				// save
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				seq = 0;
+
+				pthread_mutex_lock(&lock); // protect critical section
+				if (save_to_file(packet_buf, pos_newline+1)) { // include newline
+					seq = durable_written();
+				}
+				pthread_mutex_unlock(&lock); // release mutex
+
+				// acknowledge only once the line is durable
+				if (seq) durable_wait(seq, &start);
 			}
-		}
 
-		// packet completed
-		if(pos_newline >= 0) {
-			// save
-			pthread_mutex_lock(&lock); // protect critical section
-			save_to_file(packet_buf, pos_newline+1); // include newline
-			pthread_mutex_unlock(&lock); // release mutex
+			budget_inflight(-(pos_newline+1));
 
 			if (n_packet > pos_newline+1) {
-				memcpy(packet_buf, packet_buf + pos_newline+1, n_packet - pos_newline - 1);
+				memmove(packet_buf, packet_buf + pos_newline+1, n_packet - pos_newline - 1);
 				n_packet = n_packet - pos_newline - 1;
 			} else {
 				n_packet = 0;
 			}
 
+			if (is_stats || is_compress) continue; // no history feedback for these commands
+
 			// feedback
 			pthread_mutex_lock(&lock);
 
-			if (frw == -1) {
-				frw = open(SAVE_FILE, O_RDWR, S_IRWXU | S_IRWXG | S_IRWXO);
-			    // fr = open(SAVE_FILE, O_RDONLY);
-			}
+			open_history();
 
 			//if (fr== -1) {
 			if (frw == -1) {
 			    perror("open - rd");
 				exit(-1);
 			}
-				
-			while(1) {
-				//n_read = read(fr, recv_buf, MAX_BUF);
-				n_read = read(frw, recv_buf, MAX_BUF);
-
-				if (n_read == -1) {
-					perror("read");
-					break;
-				}
 
-				if (n_read > 0) {
-					rc = send(fd_client, recv_buf, n_read, 0);
-					if (rc == -1) {
-						perror("send");
-						break;
-					}
-				} else {
-					break;
-				}
+			if (is_range) {
+				// only the lines that arrived in the requested time range, a
+				// malformed range replays nothing
+				if (range < 0 || !hist_range(from_ns, to_ns, &pos, &end)) pos = -1;
+			} else {
+				// replay position set by the write (rewind) or by the seek command
+				pos = lseek(frw, 0, SEEK_CUR);
+				end = -1;
 			}
-			//close(fr);
 
-			//fr = -1; // for signal handler
+			if (compressed) {
+				// compressed replays work on stream offsets, the bound is needed
+				// to tell complete blocks
+				off_t cur = lseek(frw, 0, SEEK_CUR);
+				stream_start = hist_start(NULL);
+				lseek(frw, cur, SEEK_SET);
+				if (end < 0) end = hist.end - stream_start;
+			}
 
 			pthread_mutex_unlock(&lock);
-		} // if
+
+			// replay outside of the lock so that a throttled replay does not
+			// stall the writers
+			if (compressed) {
+				replay_history_compressed(fd_client, pos, end, stream_start, zraw, zcomp);
+			} else {
+				replay_history(fd_client, pos, end, recv_buf);
+			}
+		} // while (packets)
 	} // while
 
+	budget_inflight(-n_packet);
+	budget_session_end();
+	free(packet_buf);
+	free(zraw);
+	free(zcomp);
+
 	datap->thread_complete = true;
 
 	close(fd_client);  // parent doesn't need this 
@@ -482,22 +1594,79 @@ void timer_proc (int signum)
 
 int main(int argc, char *argv[])
 {
-	int fd;
+	int fd, opt;
 	pid_t pid;
+	pthread_t flusher_id;
+	bool daemon_mode = false, upgrade_mode = false;
 	//struct itimerval itv;
 	//struct sigaction sa;
 
 	// syslog
 	openlog("Assignment9", LOG_NDELAY, LOG_USER);
 
+	// options
+	//   -d : run as a daemon
+	//   -u : hot upgrade, take over the listening socket of the running server
+	//   -s <n>, -b <bytes>, -c <bytes>, -r <bytes/s> : admission control budgets
+	//   -f none|interval:<ms>|group|dsync : durability of the file backend
+	while ((opt = getopt(argc, argv, "dus:b:c:r:f:")) != -1) {
+		switch (opt) {
+			case 'd':
+				daemon_mode = true;
+				break;
+			case 'u':
+				upgrade_mode = true;
+				break;
+			case 's':
+				budget.max_sessions = atol(optarg);
+				break;
+			case 'b':
+				budget.max_inflight = atol(optarg);
+				break;
+			case 'c':
+				budget.max_client = atol(optarg);
+				break;
+			case 'r':
+				budget.max_replay = atol(optarg);
+				break;
+			case 'f':
+				if (durable_parse(optarg)) break;
+				// fall through
+			default:
+				fprintf(stderr, "Usage: %s [-d] [-u] [-s sessions] [-b inflight_bytes]"
+					" [-c client_bytes] [-r replay_bytes_per_sec]"
+					" [-f none|interval:<ms>|group|dsync]\n", argv[0]);
+				exit(-1);
+		}
+	}
+
+#ifdef USE_AESD_CHAR_DEVICE
+	if (durable.mode != DURABLE_NONE) {
+		// the char device keeps its history in memory, there is nothing to sync
+		fprintf(stderr, "server: durability mode ignored for %s\n", SAVE_FILE);
+		durable.mode = DURABLE_NONE;
+	}
+#endif
+
+	if (budget.max_client <= 0) budget.max_client = MAX_PACKET_BUF;
+
+	if (upgrade_mode) {
+		// receive the listening socket (already bound and listening)
+		if (!handoff_receive(&fd)) {
+			fprintf(stderr, "server: failed to take over listening socket\n");
+			exit(-1);
+		}
+		printf("server: took over listening socket\n");
+		syslog(LOG_DEBUG, "Took over listening socket");
+	}
 	// bind socket
-	if(!bind_socket(&fd)) {
+	else if(!bind_socket(&fd)) {
 		fprintf(stderr, "server: failed to bind\n"); 
 		exit(-1); 
 	}
 
 	// make it a daemon
-	if (argc == 2 && strcmp(argv[1], "-d") == 0) {
+	if (daemon_mode) {
 
 		printf("Daemon mode\n");
 
@@ -521,6 +1690,11 @@ int main(int argc, char *argv[])
 		exit(-1); 
 	} 
 
+	// accept hot upgrade requests (optional, keep serving without it)
+	if (!handoff_listen()) {
+		fprintf(stderr, "server: hot upgrade not available\n");
+	}
+
 	// init linked list
 	SLIST_INIT(&head); // head points to NULL
 
@@ -542,6 +1716,13 @@ int main(int argc, char *argv[])
 	//
 	catch_signals();
 
+	// background fdatasync for the interval mode (after fork, threads do not survive it)
+	if (durable.mode == DURABLE_INTERVAL
+		&& pthread_create(&flusher_id, NULL, durable_flusher, NULL) != 0) {
+		perror("Could not create flusher thread");
+		exit(-1);
+	}
+
 	// accept loop
 	accept_loop(fd);
 
@@ -0,0 +1,142 @@
+/*
+** lz-bench.c -- compression ratio and CPU cost of the replay codec
+*
+*   usage: lz-bench [file]
+*
+*   Without a file, benchmarks generated line data resembling the history
+*   (timestamp lines mixed with log lines). With a file, for instance a copy
+*   of /var/tmp/aesdsocketdata, benchmarks its content instead.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lz.h"
+
+#define BLOCK (64 * 1024)       // same block size as the server replay
+#define SAMPLE (8 * 1024 * 1024)
+#define ROUNDS 5
+
+static double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// history-like lines: timestamps every few lines, syslog style messages
+static size_t generate_lines(char *buf, size_t size)
+{
+	static const char *words[] = { "Accepted", "Closed", "connection", "from", "packet",
+		"write", "seek", "replay", "session", "bytes", "ok", "aesdchar", "client" };
+	time_t t = 1760000000;
+	size_t n = 0;
+	int line = 0, i, w;
+	struct tm tm_info;
+	char tmp[128];
+
+	srand(5713);
+
+	while (n + sizeof(tmp) < size) {
+		if (line++ % 8 == 0) {
+			t += 10;
+			gmtime_r(&t, &tm_info);
+			w = strftime(tmp, sizeof(tmp), "timestamp:%d %b %Y %T\n", &tm_info);
+		} else {
+			w = snprintf(tmp, sizeof(tmp), "aesdsocket[%d]: ", 1000 + rand() % 8);
+			for (i = 0; i < 3 + rand() % 5; i++) {
+				w += snprintf(tmp + w, sizeof(tmp) - w, "%s ", words[rand() % 13]);
+			}
+			w += snprintf(tmp + w, sizeof(tmp) - w, "10.0.%d.%d\n", rand() % 4, rand() % 256);
+		}
+		memcpy(buf + n, tmp, w);
+		n += w;
+	}
+
+	return n;
+}
+
+static size_t load_file(const char *path, char *buf, size_t size)
+{
+	FILE *f = fopen(path, "rb");
+	size_t n;
+
+	if (f == NULL) {
+		perror(path);
+		exit(-1);
+	}
+
+	n = fread(buf, 1, size, f);
+	fclose(f);
+
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	char *raw, *comp, *out;
+	size_t n, off, len, z, total_z = 0;
+	size_t offs[SAMPLE / BLOCK + 1], sizes[SAMPLE / BLOCK + 1];
+	int blocks = 0, b, r;
+	double t0, t_comp, t_decomp;
+
+	raw = malloc(SAMPLE);
+	comp = malloc(LZ_BOUND(SAMPLE));
+	out = malloc(BLOCK);
+
+	if (raw == NULL || comp == NULL || out == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	n = (argc > 1) ? load_file(argv[1], raw, SAMPLE) : generate_lines(raw, SAMPLE);
+
+	if (n == 0) {
+		fprintf(stderr, "no data\n");
+		return -1;
+	}
+
+	// compress in replay sized blocks
+	t0 = now_sec();
+	for (r = 0; r < ROUNDS; r++) {
+		total_z = 0;
+		blocks = 0;
+		for (off = 0; off < n; off += BLOCK) {
+			len = (n - off > BLOCK) ? BLOCK : n - off;
+			z = lz_compress(raw + off, len, comp + total_z, LZ_BOUND(len));
+			offs[blocks] = total_z;
+			sizes[blocks++] = z;
+			total_z += z;
+		}
+	}
+	t_comp = (now_sec() - t0) / ROUNDS;
+
+	t0 = now_sec();
+	for (r = 0; r < ROUNDS; r++) {
+		for (b = 0, off = 0; b < blocks; b++, off += BLOCK) {
+			len = (n - off > BLOCK) ? BLOCK : n - off;
+			if (lz_decompress(comp + offs[b], sizes[b], out, BLOCK) != (ssize_t) len
+				|| memcmp(out, raw + off, len) != 0) {
+				fprintf(stderr, "block %d: round trip mismatch\n", b);
+				return -1;
+			}
+		}
+	}
+	t_decomp = (now_sec() - t0) / ROUNDS;
+
+	printf("input:       %zu bytes (%s)\n", n, argc > 1 ? argv[1] : "generated lines");
+	printf("compressed:  %zu bytes in %d blocks of %d\n", total_z, blocks, BLOCK);
+	printf("ratio:       %.2f\n", (double) n / total_z);
+	printf("compress:    %.1f MB/s\n", n / t_comp / 1e6);
+	printf("decompress:  %.1f MB/s\n", n / t_decomp / 1e6);
+
+	free(raw);
+	free(comp);
+	free(out);
+
+	return 0;
+}
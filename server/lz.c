@@ -0,0 +1,181 @@
+/*
+** lz.c -- small LZ77 block codec used for compressed replays
+*
+*   The output follows the LZ4 block layout: a sequence of
+*   [token][literal length ext][literals][offset LE16][match length ext],
+*   the token holding the literal length (high nibble) and the match
+*   length - 4 (low nibble), 15 meaning "more length bytes follow".
+*   The last sequence carries literals only.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+#define MF_LIMIT 12      // no match starts in the last 12 bytes
+#define LAST_LITERALS 5  // the last 5 bytes are always literals
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static unsigned int hash32(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static unsigned char *put_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char) len;
+
+	return op;
+}
+
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *literals,
+	size_t lit, size_t offset, size_t mlen, bool last)
+{
+	unsigned char *token = op++;
+
+	*token = (lit >= 15 ? 15 : lit) << 4;
+	if (lit >= 15) op = put_length(op, lit - 15);
+
+	memcpy(op, literals, lit);
+	op += lit;
+
+	if (last) return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	mlen -= MIN_MATCH;
+	*token |= (mlen >= 15 ? 15 : mlen);
+	if (mlen >= 15) op = put_length(op, mlen - 15);
+
+	return op;
+}
+
+size_t lz_compress(const char *source, size_t n, char *dest, size_t cap)
+{
+	const unsigned char *src = (const unsigned char *) source;
+	const unsigned char *ip = src, *anchor = src, *end = src + n;
+	const unsigned char *ref, *mp, *rp;
+	unsigned char *op = (unsigned char *) dest;
+	uint32_t table[1 << HASH_LOG];
+	uint32_t seq;
+	unsigned int h;
+
+	// the bound covers incompressible input, no need to check while writing
+	if (cap < LZ_BOUND(n)) return 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (n > MF_LIMIT && ip < end - MF_LIMIT) {
+		seq = read32(ip);
+		h = hash32(seq);
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		// extend the match backwards over pending literals, then forwards
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		mp = ip + MIN_MATCH;
+		rp = ref + MIN_MATCH;
+		while (mp < end - LAST_LITERALS && *mp == *rp) {
+			mp++;
+			rp++;
+		}
+
+		op = put_sequence(op, anchor, ip - anchor, ip - ref, mp - ip, false);
+
+		ip = anchor = mp;
+
+		if (ip < end - MF_LIMIT) table[hash32(read32(ip - 2))] = ip - 2 - src;
+	}
+
+	op = put_sequence(op, anchor, end - anchor, 0, 0, true);
+
+	return op - (unsigned char *) dest;
+}
+
+ssize_t lz_decompress(const char *source, size_t n, char *dest, size_t cap)
+{
+	const unsigned char *ip = (const unsigned char *) source, *iend = ip + n;
+	unsigned char *op = (unsigned char *) dest, *oend = op + cap;
+	const unsigned char *ref;
+	size_t lit, mlen, offset;
+	unsigned char b;
+
+	while (ip < iend) {
+		lit = *ip >> 4;
+		mlen = *ip++ & 15;
+
+		if (lit == 15) {
+			do {
+				if (ip >= iend) return -1;
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+
+		if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op)) return -1;
+
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		// the last sequence has no match
+		if (ip == iend) break;
+
+		if (iend - ip < 2) return -1;
+
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (offset == 0 || offset > (size_t) (op - (unsigned char *) dest)) return -1;
+
+		if (mlen == 15) {
+			do {
+				if (ip >= iend) return -1;
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += MIN_MATCH;
+
+		if (mlen > (size_t) (oend - op)) return -1;
+
+		ref = op - offset;
+
+		if (offset >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			// overlapping copy repeats the last offset bytes
+			while (mlen--) *op++ = *ref++;
+		}
+	}
+
+	return op - (unsigned char *) dest;
+}
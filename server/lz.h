@@ -0,0 +1,22 @@
+/*
+** lz.h -- small LZ77 block codec (LZ4 block layout) used for compressed replays
+*/
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// worst case compressed size of n bytes
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+// compress n bytes of src into dst (cap bytes), returns the compressed size
+// or 0 if dst is too small
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap);
+
+// decompress n bytes of src into dst (cap bytes), returns the decompressed
+// size or -1 if src is corrupted or dst is too small
+ssize_t lz_decompress(const char *src, size_t n, char *dst, size_t cap);
+
+#endif /* LZ_H */
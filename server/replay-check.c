@@ -0,0 +1,151 @@
+/*
+** replay-check.c -- checks the compressed replays of a running aesdsocket
+*
+*   usage: replay-check [host]
+*
+*   Turns compressed replays on (AESDSOCKET_COMPRESS:1), then sends lines of
+*   random printable bytes, which do not compress: their blocks go out as
+*   stored frames. After every line, the frames of the replay are decoded and
+*   compared with the lines sent so far, so the server must start with an
+*   empty history. The history grows past a few ZBLOCK blocks, and every
+*   complete block is replayed again, once it may have been cached.
+*
+*   Exits with 0 when every replay matched.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "lz.h"
+
+#define PORT "9000"
+#define LINES 160
+#define LINE_SIZE 1000
+#define FRAME_MAX (64 * 1024)  // ZBLOCK of the server
+
+static bool recv_all(int fd, void *buf, size_t n)
+{
+	ssize_t rc;
+
+	while (n > 0) {
+		rc = recv(fd, buf, n, 0);
+		if (rc <= 0) return false;
+		buf = (char *) buf + rc;
+		n -= rc;
+	}
+
+	return true;
+}
+
+// decodes one replay into out (cap bytes), returns its size or -1
+static ssize_t recv_replay(int fd, char *out, size_t cap)
+{
+	static char payload[LZ_BOUND(FRAME_MAX)];
+	uint32_t header[2], raw_len, len;
+	size_t n = 0;
+
+	for (;;) {
+		if (!recv_all(fd, header, sizeof(header))) return -1;
+
+		raw_len = ntohl(header[0]);
+		len = ntohl(header[1]);
+
+		// end of replay
+		if (raw_len == 0) return n;
+
+		if (raw_len > FRAME_MAX || len > sizeof(payload) || raw_len > cap - n) return -1;
+		if (!recv_all(fd, payload, len)) return -1;
+
+		if (len == raw_len) {
+			memcpy(out + n, payload, len);
+		} else if (lz_decompress(payload, len, out + n, raw_len) != raw_len) {
+			return -1;
+		}
+		n += raw_len;
+	}
+}
+
+static int connect_server(const char *host)
+{
+	struct addrinfo hints, *info;
+	struct timeval timeout = { 5, 0 };
+	int fd;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, PORT, &hints, &info) != 0) return -1;
+
+	fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+	if (fd != -1 && connect(fd, info->ai_addr, info->ai_addrlen) == -1) {
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(info);
+
+	// a replay missing its end frame fails the check instead of hanging it
+	if (fd != -1) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	static char sent[LINES * LINE_SIZE], replay[LINES * LINE_SIZE];
+	char reply[32];
+	const char *host = (argc > 1) ? argv[1] : "localhost";
+	ssize_t n;
+	int fd, i, j;
+
+	fd = connect_server(host);
+	if (fd == -1) {
+		perror("connect");
+		return 1;
+	}
+
+	if (send(fd, "AESDSOCKET_COMPRESS:1\n", 22, 0) != 22
+		|| !recv_all(fd, reply, 22) || strncmp(reply, "AESDSOCKET_COMPRESS:1\n", 22) != 0) {
+		fprintf(stderr, "compressed replays not accepted\n");
+		return 1;
+	}
+
+	srand(1);
+
+	for (i = 0; i < LINES; i++) {
+		char *line = sent + i * LINE_SIZE;
+
+		for (j = 0; j < LINE_SIZE - 1; j++) {
+			line[j] = ' ' + 1 + rand() % 94;
+		}
+		line[LINE_SIZE - 1] = '\n';
+
+		if (send(fd, line, LINE_SIZE, 0) != LINE_SIZE) {
+			perror("send");
+			return 1;
+		}
+
+		n = recv_replay(fd, replay, sizeof(replay));
+
+		if (n != (i + 1) * LINE_SIZE || memcmp(replay, sent, n) != 0) {
+			fprintf(stderr, "line %d: replay of %zd bytes, %d expected%s\n", i + 1, n,
+				(i + 1) * LINE_SIZE, n > 0 ? " (content differs)" : "");
+			return 1;
+		}
+	}
+
+	close(fd);
+
+	printf("%d compressed replays of incompressible lines: ok\n", LINES);
+
+	return 0;
+}
@@ -0,0 +1,406 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Tests of the logical offsets of aesd-circular-buffer.c once the buffer wrapped around:
+* fpos to entry and entry to fpos lookups (binary search on the running offsets), entry
+* boundaries, the end of the history, and resizing the entry array up and down.
+*/
+
+#define N_WRITES 13
+
+// entry i holds i + 1 times the letter 'a' + i, sizes differ so that a wrong entry shows
+static char contents[N_WRITES][N_WRITES + 1];
+
+static void write_entries(struct aesd_circular_buffer *buffer, unsigned int first, unsigned int n)
+{
+    struct aesd_buffer_entry entry;
+    unsigned int i;
+
+    for (i = first; i < first + n; i++) {
+        memset(contents[i], 'a' + i, i + 1);
+        contents[i][i + 1] = '\0';
+        entry.buffptr = contents[i];
+        entry.size = i + 1;
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+/**
+* Checks that @param buffer holds the entries first..last (write order) of contents, from
+* fpos 0, by looking up the first and the last byte of each entry both ways
+*/
+static void check_history(struct aesd_circular_buffer *buffer, unsigned int first, unsigned int last)
+{
+    struct aesd_buffer_entry *entry;
+    size_t fpos = 0, offset, rtn;
+    unsigned int i;
+
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(last - first + 1, aesd_circular_buffer_count(buffer), "entry count");
+
+    for (i = first; i <= last; i++) {
+        // first byte of the entry, on the boundary with the previous one
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "entry at its first byte");
+        TEST_ASSERT_EQUAL_PTR(contents[i], entry->buffptr);
+        TEST_ASSERT_EQUAL_UINT(0, offset);
+
+        // last byte of the entry
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos + i, &offset);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "entry at its last byte");
+        TEST_ASSERT_EQUAL_PTR(contents[i], entry->buffptr);
+        TEST_ASSERT_EQUAL_UINT(i, offset);
+
+        // and back to the fpos
+        TEST_ASSERT_TRUE(aesd_circular_buffer_find_fpos_for_entry(buffer, i - first, 0, &rtn));
+        TEST_ASSERT_EQUAL_UINT(fpos, rtn);
+        TEST_ASSERT_TRUE(aesd_circular_buffer_find_fpos_for_entry(buffer, i - first, i, &rtn));
+        TEST_ASSERT_EQUAL_UINT(fpos + i, rtn);
+
+        fpos += i + 1;
+    }
+
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(fpos, buffer->size, "history size");
+}
+
+void test_circular_buffer_fpos_to_entry_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    size_t offset;
+
+    aesd_circular_buffer_init(&buffer);
+    write_entries(&buffer, 0, N_WRITES);
+
+    // 3 entries overwritten, out_offs is no longer 0
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT(3, buffer.out_offs);
+    TEST_ASSERT_EQUAL_UINT64(1 + 2 + 3, buffer.base);
+
+    check_history(&buffer, 3, N_WRITES - 1);
+
+    // end of the history: the last byte is found, the next one is not
+    TEST_ASSERT_NOT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, buffer.size - 1, &offset));
+    TEST_ASSERT_EQUAL_UINT(N_WRITES - 1, offset);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, buffer.size, &offset));
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, buffer.size + 100, &offset));
+}
+
+void test_circular_buffer_entry_to_fpos_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    size_t fpos, offset, rtn;
+
+    aesd_circular_buffer_init(&buffer);
+    write_entries(&buffer, 0, N_WRITES);
+
+    // every byte round trips through both lookups
+    for (fpos = 0; fpos < buffer.size; fpos++) {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, fpos, &offset);
+        TEST_ASSERT_NOT_NULL(entry);
+        TEST_ASSERT_TRUE(aesd_circular_buffer_find_fpos_for_entry(&buffer,
+            (entry - buffer.entry + buffer.capacity - buffer.out_offs) % buffer.capacity, offset, &rtn));
+        TEST_ASSERT_EQUAL_UINT(fpos, rtn);
+    }
+
+    // past the last entry, or past the end of an entry
+    TEST_ASSERT_FALSE(aesd_circular_buffer_find_fpos_for_entry(&buffer, 10, 0, &rtn));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_find_fpos_for_entry(&buffer, 0, 4, &rtn));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_find_fpos_for_entry(&buffer, 9, N_WRITES, &rtn));
+}
+
+void test_circular_buffer_empty()
+{
+    struct aesd_circular_buffer buffer;
+    size_t offset, rtn;
+
+    aesd_circular_buffer_init(&buffer);
+
+    TEST_ASSERT_EQUAL_UINT(0, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_find_fpos_for_entry(&buffer, 0, 0, &rtn));
+}
+
+void test_circular_buffer_torn_empty()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry removed;
+    size_t offset, size;
+
+    aesd_circular_buffer_init(&buffer);
+    write_entries(&buffer, 0, 2);
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_entry(&buffer, &removed));
+
+    // a lockless reader sees the size from before the last entry was evicted
+    // (aesd_set_max_bytes can empty the buffer) and the offsets from after it
+    size = buffer.size;
+    TEST_ASSERT_TRUE(aesd_circular_buffer_remove_entry(&buffer, &removed));
+    TEST_ASSERT_EQUAL_UINT(0, aesd_circular_buffer_count(&buffer));
+    buffer.size = size;
+
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 1, &offset));
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset));
+}
+
+void test_circular_buffer_resize_up_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entries = calloc(16, sizeof(struct aesd_buffer_entry));
+    struct aesd_buffer_entry *old;
+
+    TEST_ASSERT_NOT_NULL(entries);
+
+    aesd_circular_buffer_init(&buffer);
+    write_entries(&buffer, 0, N_WRITES);
+
+    old = aesd_circular_buffer_resize(&buffer, entries, 16);
+
+    // the inline array needs no release, the entries keep their order and offsets
+    TEST_ASSERT_NULL(old);
+    TEST_ASSERT_EQUAL_UINT(16, buffer.capacity);
+    TEST_ASSERT_FALSE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT64(1 + 2 + 3, buffer.base);
+    check_history(&buffer, 3, N_WRITES - 1);
+
+    // 6 more entries fit before the oldest is overwritten again
+    write_entries(&buffer, 0, 3);
+    write_entries(&buffer, 0, 3);
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT(16, aesd_circular_buffer_count(&buffer));
+
+    free(entries);
+}
+
+void test_circular_buffer_resize_down_wrapped()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entries = calloc(4, sizeof(struct aesd_buffer_entry));
+    struct aesd_buffer_entry removed;
+    uint64_t base;
+
+    TEST_ASSERT_NOT_NULL(entries);
+
+    aesd_circular_buffer_init(&buffer);
+    write_entries(&buffer, 0, N_WRITES);
+
+    // the caller removes the oldest entries which do not fit first
+    while (aesd_circular_buffer_count(&buffer) > 4) {
+        TEST_ASSERT_TRUE(aesd_circular_buffer_remove_entry(&buffer, &removed));
+    }
+    base = buffer.base;
+    TEST_ASSERT_EQUAL_UINT64(1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9, base);
+
+    aesd_circular_buffer_resize(&buffer, entries, 4);
+
+    TEST_ASSERT_EQUAL_UINT(4, buffer.capacity);
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT64(base, buffer.base);
+    check_history(&buffer, 9, N_WRITES - 1);
+
+    // the next entry overwrites the oldest one, fpos 0 moves past it
+    write_entries(&buffer, 0, 1);
+    TEST_ASSERT_EQUAL_UINT(4, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT64(base + 10, buffer.base);
+    TEST_ASSERT_EQUAL_UINT(11 + 12 + 13 + 1, buffer.size);
+
+    free(entries);
+}
+
+/**
+* Tests of the cursor, which walks the history in logical order (oldest first) and merges the
+* entries stored one after the other into a single span
+*/
+
+// adds the string @param s as an entry stored in the ring of @param buffer, as aesd_core_make_room does
+static void ring_add(struct aesd_circular_buffer *buffer, const char *s)
+{
+    struct aesd_buffer_entry entry, removed;
+    char *dst;
+
+    entry.size = strlen(s);
+
+    while (aesd_circular_buffer_needs_eviction(buffer, entry.size)) {
+        aesd_circular_buffer_remove_entry(buffer, &removed);
+    }
+    while ((dst = aesd_circular_buffer_reserve(buffer, entry.size)) == NULL) {
+        TEST_ASSERT_TRUE(aesd_circular_buffer_remove_entry(buffer, &removed));
+    }
+
+    memcpy(dst, s, entry.size);
+    entry.buffptr = dst;
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+static void ring_init(struct aesd_circular_buffer *buffer, char *ring, size_t ring_size)
+{
+    aesd_circular_buffer_init(buffer);
+    buffer->ring = ring;
+    buffer->ring_size = ring_size;
+}
+
+void test_circular_buffer_cursor_wrapped_order()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_cursor cursor;
+    struct aesd_buffer_entry *entry;
+    struct aesd_ring_span span;
+    unsigned int i, index;
+
+    aesd_circular_buffer_init(&buffer);
+    write_entries(&buffer, 0, N_WRITES);
+
+    // entries in caller memory which are not adjacent: one span per entry, oldest first
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_init(&buffer, &cursor, 0));
+    for (i = 3; i < N_WRITES; i++) {
+        TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+        TEST_ASSERT_EQUAL_PTR(contents[i], span.ptr);
+        TEST_ASSERT_EQUAL_UINT(i + 1, span.len);
+    }
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+
+    // same order for the logical foreach
+    AESD_CIRCULAR_BUFFER_FOREACH_LOGICAL(entry, &buffer, index) {
+        TEST_ASSERT_EQUAL_PTR(contents[index + 3], entry->buffptr);
+    }
+    TEST_ASSERT_EQUAL_UINT(N_WRITES - 3, index);
+}
+
+void test_circular_buffer_cursor_merges_ring_spans()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_cursor cursor;
+    struct aesd_ring_span span;
+    char ring[32];
+
+    ring_init(&buffer, ring, sizeof(ring));
+    ring_add(&buffer, "ab\n");
+    ring_add(&buffer, "cde\n");
+    ring_add(&buffer, "f\n");
+
+    // the three entries follow each other in the ring: a single span
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_init(&buffer, &cursor, 0));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+    TEST_ASSERT_EQUAL_PTR(ring, span.ptr);
+    TEST_ASSERT_EQUAL_UINT(9, span.len);
+    TEST_ASSERT_EQUAL_MEMORY("ab\ncde\nf\n", span.ptr, 9);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+
+    // max_len stops the merge once reached, the span may still be longer
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_init(&buffer, &cursor, 0));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_next(&cursor, 4, &span));
+    TEST_ASSERT_EQUAL_PTR(ring, span.ptr);
+    TEST_ASSERT_EQUAL_UINT(7, span.len);
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_next(&cursor, 4, &span));
+    TEST_ASSERT_EQUAL_PTR(ring + 7, span.ptr);
+    TEST_ASSERT_EQUAL_UINT(2, span.len);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_next(&cursor, 4, &span));
+}
+
+void test_circular_buffer_cursor_wrapped_ring()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_cursor cursor;
+    struct aesd_ring_span span;
+    char ring[16];
+
+    ring_init(&buffer, ring, sizeof(ring));
+    ring_add(&buffer, "aaaaa\n");
+    ring_add(&buffer, "bbbbb\n");
+    // does not fit at the end of the ring: the first entry goes, this one starts at 0
+    ring_add(&buffer, "ccccc\n");
+
+    TEST_ASSERT_EQUAL_UINT(2, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT(12, buffer.ring_wrap);
+
+    // the end of the ring, then its start: two spans even with no limit
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_init(&buffer, &cursor, 0));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+    TEST_ASSERT_EQUAL_PTR(ring + 6, span.ptr);
+    TEST_ASSERT_EQUAL_MEMORY("bbbbb\n", span.ptr, 6);
+    TEST_ASSERT_EQUAL_UINT(6, span.len);
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+    TEST_ASSERT_EQUAL_PTR(ring, span.ptr);
+    TEST_ASSERT_EQUAL_MEMORY("ccccc\n", span.ptr, 6);
+    TEST_ASSERT_EQUAL_UINT(6, span.len);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+
+    // the entry at the end of the ring goes, the next one follows the one at 0
+    ring_add(&buffer, "ddd\n");
+    TEST_ASSERT_EQUAL_UINT(0, buffer.ring_wrap);
+
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_init(&buffer, &cursor, 0));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+    TEST_ASSERT_EQUAL_PTR(ring, span.ptr);
+    TEST_ASSERT_EQUAL_UINT(10, span.len);
+    TEST_ASSERT_EQUAL_MEMORY("ccccc\nddd\n", span.ptr, 10);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+}
+
+void test_circular_buffer_cursor_mid_entry()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_cursor cursor;
+    struct aesd_ring_span span;
+    char ring[32];
+    unsigned int i;
+
+    // caller memory, wrapped: third byte of the oldest entry (4 bytes)
+    aesd_circular_buffer_init(&buffer);
+    write_entries(&buffer, 0, N_WRITES);
+
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_init(&buffer, &cursor, 2));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+    TEST_ASSERT_EQUAL_PTR(contents[3] + 2, span.ptr);
+    TEST_ASSERT_EQUAL_UINT(2, span.len);
+
+    // the next entries are whole
+    for (i = 4; i < N_WRITES; i++) {
+        TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+        TEST_ASSERT_EQUAL_PTR(contents[i], span.ptr);
+        TEST_ASSERT_EQUAL_UINT(i + 1, span.len);
+    }
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+
+    // in the ring, the rest of the entry merges with the following ones
+    ring_init(&buffer, ring, sizeof(ring));
+    ring_add(&buffer, "ab\n");
+    ring_add(&buffer, "cde\n");
+    ring_add(&buffer, "f\n");
+
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_init(&buffer, &cursor, 4));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+    TEST_ASSERT_EQUAL_PTR(ring + 4, span.ptr);
+    TEST_ASSERT_EQUAL_UINT(5, span.len);
+    TEST_ASSERT_EQUAL_MEMORY("de\nf\n", span.ptr, 5);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+}
+
+void test_circular_buffer_cursor_empty_and_end()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer_cursor cursor;
+    struct aesd_ring_span span;
+
+    // empty buffer: nothing to walk
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_init(&buffer, &cursor, 0));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+
+    write_entries(&buffer, 0, N_WRITES);
+
+    // end of the history, or past it: the cursor yields nothing
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_init(&buffer, &cursor, buffer.size));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_init(&buffer, &cursor, buffer.size + 1));
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+
+    // the last byte is a span of its own
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_init(&buffer, &cursor, buffer.size - 1));
+    TEST_ASSERT_TRUE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+    TEST_ASSERT_EQUAL_PTR(contents[N_WRITES - 1] + N_WRITES - 1, span.ptr);
+    TEST_ASSERT_EQUAL_UINT(1, span.len);
+    TEST_ASSERT_FALSE(aesd_circular_buffer_cursor_next(&cursor, SIZE_MAX, &span));
+}